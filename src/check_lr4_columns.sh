@@ -0,0 +1,41 @@
+#!/usr/bin/env bash
+# Проверка lr4_zipf на текстовом потоке lr3_token с колонками docid и id поля:
+# частоты по "docid\ttoken\tfield" должны совпасть с частотами по потоку без
+# колонок и по бинарному IRTK. Запуск: ./check_lr4_columns.sh (из src/).
+set -euo pipefail
+
+src=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+CXX=${CXX:-g++}
+"$CXX" -std=c++17 -O2 -pthread -o "$tmp/lr3_token" "$src/lr3_token.cpp"
+"$CXX" -std=c++17 -O2 -pthread -o "$tmp/lr4_zipf" "$src/lr4_zipf.cpp"
+
+# Числовые токены ("2024", "7") проверяют, что docid не путается с термом.
+words=(Москва москва Ёлка поиск индекс данные Hello WORLD test 2024 7)
+{
+    echo "["
+    for ((d = 0; d < 300; d++)); do
+        text=""
+        for ((k = 0; k < d % 37 + 1; k++)); do text+="${words[(d * 7 + k * k) % ${#words[@]}]} "; done
+        title="${words[d % ${#words[@]}]}_${words[(d / 3) % ${#words[@]}]}"
+        [ "$d" -gt 0 ] && echo ","
+        printf '{"url_norm": "https://ru.wikipedia.org/wiki/%s", "parsed_text": "%s"}' "$title" "$text"
+    done
+    echo "]"
+} > "$tmp/docs.json"
+
+run() {
+    local name=$1; shift
+    "$tmp/lr3_token" --json "$tmp/docs.json" --fields title "$@" --emit_tokens "$tmp/$name.tok" > /dev/null
+    (cd "$tmp" && ./lr4_zipf "$name.tok" "$name.tsv" > /dev/null)
+}
+
+run plain --with_docid 0
+run docid --with_docid 1
+run bin --format bin
+
+cmp "$tmp/plain.tsv" "$tmp/docid.tsv"
+cmp "$tmp/plain.tsv" "$tmp/bin.tsv"
+echo "OK: lr4_zipf counts the same terms with and without docid/field columns"
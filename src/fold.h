@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Простая свёртка регистра (Unicode simple case folding), общая для lr3_token,
+// lr5_stem, lr6_index и lr7_search: токены при индексации и термы запросов
+// должны нормализоваться одинаково, поэтому правила живут только здесь.
+// ASCII и кириллица U+0400..U+052F, опционально ё -> е. Все затронутые символы
+// двухбайтовые и остаются двухбайтовыми, поэтому длина токена не меняется.
+// Таблица индексируется ведущим байтом D0..D4 и младшими 6 битами байта
+// продолжения.
+static uint16_t g_fold2[5 * 64];
+
+static void init_fold_tables(bool fold_yo) {
+    for (uint32_t idx = 0; idx < 5 * 64; idx++) {
+        uint32_t cp = 0x0400u + idx, f = cp;
+        if (cp <= 0x040Fu) f = cp + 0x50u;
+        else if (cp <= 0x042Fu) f = cp + 0x20u;
+        else if ((cp >= 0x0460u && cp <= 0x0481u) || (cp >= 0x048Au && cp <= 0x04BFu) ||
+                 (cp >= 0x04D0u && cp <= 0x052Fu)) { if (!(cp & 1u)) f = cp + 1u; }
+        else if (cp == 0x04C0u) f = 0x04CFu;
+        else if (cp >= 0x04C1u && cp <= 0x04CEu) { if (cp & 1u) f = cp + 1u; }
+        if (fold_yo && f == 0x0451u) f = 0x0435u;
+        g_fold2[idx] = (uint16_t)(((0xC0u | (f >> 6)) << 8) | (0x80u | (f & 0x3Fu)));
+    }
+}
+
+static void fold_bytes(char* dst, const char* src, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        uint8_t b = (uint8_t)src[i];
+        if (b < 0x80u) {
+            dst[i] = (char)((b >= 'A' && b <= 'Z') ? (b | 0x20u) : b);
+            i++;
+        } else if (b >= 0xD0u && b <= 0xD4u && i + 1 < n && (((uint8_t)src[i+1]) & 0xC0u) == 0x80u) {
+            uint16_t f = g_fold2[((b - 0xD0u) << 6) | ((uint8_t)src[i+1] & 0x3Fu)];
+            dst[i] = (char)(f >> 8);
+            dst[i+1] = (char)(f & 0xFFu);
+            i += 2;
+        } else {
+            dst[i] = (char)b;
+            i++;
+        }
+    }
+}
+
+static inline std::string fold_term(std::string s) {
+    if (!s.empty()) fold_bytes(&s[0], s.data(), s.size());
+    return s;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Индекс IRIX v2 — единственный писатель формата для lr6_index и
+// lr3_token --index; lr7_search берёт отсюда флаги META.
+//   заголовок: "IRIX", u32 version, u32 sections, u64 table_off;
+//   секции подряд, в конце таблица: на секцию u32 type, u32 flags,
+//   u64 offset, u64 size.
+//   META (4):     u32 docs_count, u64 total_tokens, u32 unique_terms,
+//                 f64 avg_term_len, f64 build_ms; flags — kMetaFold*;
+//   DICT (1):     u32 count, затем по возрастанию термов u16 len, терм,
+//                 u32 df, u64 cf, u64 postings_off (в байтах POSTINGS);
+//   POSTINGS (2): возрастающие u32 docid каждого терма подряд;
+//   FORWARD (3):  u32 count, затем на docid u32 len + url, u32 len + title.
+static const uint32_t kIrixVersion = 2;
+
+// Флаги секции META: термы свёрнуты по регистру / ё заменена на е.
+static const uint32_t kMetaFoldCase = 1u;
+static const uint32_t kMetaFoldYo   = 2u;
+
+[[noreturn]] static inline void irix_fail(const std::string& msg) {
+    std::fprintf(stderr, "ERROR: %s\n", msg.c_str());
+    std::exit(1);
+}
+
+template <class T>
+static inline void irix_put(std::string& out, T v) {
+    out.append((const char*)&v, sizeof(v));
+}
+
+static inline int hexval(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return 10 + (c - 'a');
+    if (c >= 'A' && c <= 'F') return 10 + (c - 'A');
+    return -1;
+}
+
+static inline std::string percent_decode(const std::string& s) {
+    std::string out;
+    out.reserve(s.size());
+    for (size_t i = 0; i < s.size(); ) {
+        if (s[i] == '%' && i + 2 < s.size() && hexval(s[i+1]) >= 0 && hexval(s[i+2]) >= 0) {
+            out.push_back((char)((hexval(s[i+1]) << 4) | hexval(s[i+2])));
+            i += 3;
+            continue;
+        }
+        out.push_back(s[i] == '+' ? ' ' : s[i]);
+        i++;
+    }
+    return out;
+}
+
+// Заголовок документа для FORWARD: хвост url_norm после /wiki/ (или после
+// последнего '/'), '_' -> пробел, percent-декодирование.
+static inline std::string title_from_url_norm(const std::string& url) {
+    std::string tail = url;
+    size_t p = url.find("/wiki/");
+    if (p != std::string::npos) tail = url.substr(p + 6);
+    else {
+        size_t s = url.find_last_of('/');
+        if (s != std::string::npos && s + 1 < url.size()) tail = url.substr(s + 1);
+    }
+    for (char& c : tail) if (c == '_') c = ' ';
+    return percent_decode(tail);
+}
+
+struct IrixWriter {
+    std::string dict;      // записи DICT без счётчика
+    std::string postings;
+    uint32_t unique_terms = 0;
+    uint64_t total_tokens = 0;
+    uint64_t sum_term_len = 0;
+
+    // Термы подаются по возрастанию; docs — возрастающие docid без повторов.
+    void add_term(const char* term, size_t len, const uint32_t* docs, uint32_t df, uint64_t cf) {
+        if (len > 65535) irix_fail("Term too long (>65535 bytes): " + std::string(term, len));
+        const uint64_t postings_off = postings.size();
+        postings.append((const char*)docs, (size_t)df * sizeof(uint32_t));
+        irix_put(dict, (uint16_t)len);
+        dict.append(term, len);
+        irix_put(dict, df);
+        irix_put(dict, cf);
+        irix_put(dict, postings_off);
+        sum_term_len += (uint64_t)len * cf;
+        total_tokens += cf;
+        unique_terms++;
+    }
+
+    double avg_term_len() const {
+        return unique_terms ? (double)sum_term_len / (double)total_tokens : 0.0;
+    }
+
+    // urls[d] — url_norm документа d (может не хватать или быть пустым);
+    // без url заголовок — "Document d".
+    void write(const std::string& path, uint32_t docs_count, uint32_t meta_flags, double build_ms,
+               const std::vector<std::string>& urls) const {
+        std::string meta;
+        irix_put(meta, docs_count);
+        irix_put(meta, total_tokens);
+        irix_put(meta, unique_terms);
+        irix_put(meta, avg_term_len());
+        irix_put(meta, build_ms);
+
+        std::string dict_sec;
+        irix_put(dict_sec, unique_terms);
+
+        std::string fwd;
+        irix_put(fwd, docs_count);
+        for (uint32_t d = 0; d < docs_count; d++) {
+            static const std::string kNone;
+            const std::string& url = d < urls.size() ? urls[d] : kNone;
+            std::string title = url.empty() ? std::string() : title_from_url_norm(url);
+            if (title.empty()) title = "Document " + std::to_string(d);
+            irix_put(fwd, (uint32_t)url.size());
+            fwd.append(url);
+            irix_put(fwd, (uint32_t)title.size());
+            fwd.append(title);
+        }
+
+        FILE* f = std::fopen(path.c_str(), "wb");
+        if (!f) irix_fail("Cannot open output file: " + path);
+        const uint32_t types[4] = {4, 1, 2, 3};
+        const std::string* parts[5] = {&meta, &dict_sec, &dict, &postings, &fwd};
+        const uint64_t sizes[4] = {meta.size(), dict_sec.size() + dict.size(), postings.size(), fwd.size()};
+        std::string head("IRIX", 4), table;
+        irix_put(head, kIrixVersion);
+        irix_put(head, (uint32_t)4);
+        uint64_t off = 20;
+        for (int k = 0; k < 4; k++) {
+            irix_put(table, types[k]);
+            irix_put(table, k == 0 ? meta_flags : 0u);
+            irix_put(table, off);
+            irix_put(table, sizes[k]);
+            off += sizes[k];
+        }
+        irix_put(head, off);
+        bool ok = std::fwrite(head.data(), 1, head.size(), f) == head.size();
+        for (const std::string* s : parts) ok = ok && std::fwrite(s->data(), 1, s->size(), f) == s->size();
+        ok = ok && std::fwrite(table.data(), 1, table.size(), f) == table.size();
+        if (std::fclose(f) != 0 || !ok) irix_fail("Cannot write index file: " + path);
+    }
+};
@@ -1,15 +1,57 @@
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
 #include <cstdint>
 #include <cstring>
 #include <string>
+#include <string_view>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fold.h"
+#include "irix.h"
+#include "token_stream.h"
 
 static void die(const char* msg) {
     std::fprintf(stderr, "ERROR: %s\n", msg);
     std::exit(1);
 }
 
+// Счётчик выделений памяти (allocs в отчёте --bench) — только в сборке с
+// -DLR3_BENCH: общий atomic на каждом new тормозил бы рабочие потоки.
+#ifdef LR3_BENCH
+static std::atomic<uint64_t> g_allocs{0};
+
+void* operator new(size_t n) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
 static bool read_file_all(const char* path, std::string& out) {
     out.clear();
     FILE* f = std::fopen(path, "rb");
@@ -27,6 +69,63 @@ static bool read_file_all(const char* path, std::string& out) {
     return true;
 }
 
+// Вход отображается через mmap; пройденные сканером страницы отдаются ядру
+// (MADV_DONTNEED), так что RSS не зависит от размера выгрузки.
+// Если mmap недоступен (пайп, пустой файл) — читаем файл в память.
+static const size_t kReleaseWindow = (size_t)64 << 20;
+
+struct JsonInput {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    bool mapped = false;
+    size_t released = 0;
+    std::string owned;
+
+    bool open(const char* path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd >= 0) {
+            struct stat sb;
+            if (::fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+                void* p = ::mmap(nullptr, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    ::madvise(p, (size_t)sb.st_size, MADV_SEQUENTIAL);
+                    ::close(fd);
+                    data = (const char*)p;
+                    size = (size_t)sb.st_size;
+                    mapped = true;
+                    return true;
+                }
+            }
+            ::close(fd);
+        }
+        if (!read_file_all(path, owned)) return false;
+        data = owned.data();
+        size = owned.size();
+        return true;
+    }
+
+    void assign(std::string data_) {
+        owned = std::move(data_);
+        data = owned.data();
+        size = owned.size();
+    }
+
+    // Всё, что лежит левее off, сканеру больше не понадобится.
+    void release_before(size_t off) {
+        if (!mapped || off < released + kReleaseWindow) return;
+        size_t page = (size_t)::sysconf(_SC_PAGESIZE);
+        size_t upto = off / page * page;
+        if (upto <= released) return;
+        ::madvise((void*)(data + released), upto - released, MADV_DONTNEED);
+        released = upto;
+    }
+
+    ~JsonInput() {
+        if (mapped) ::munmap((void*)data, size);
+    }
+};
+
 static inline bool is_ws(char c) {
     return c==' ' || c=='\n' || c=='\r' || c=='\t';
 }
@@ -35,14 +134,14 @@ static inline bool is_ws(char c) {
 
 static inline bool is_cont(uint8_t b) { return (b & 0xC0u) == 0x80u; }
 
-static uint32_t utf8_next(const std::string& s, size_t& pos) {
-    if (pos >= s.size()) return 0;
+static uint32_t utf8_next(const char* s, size_t n, size_t& pos) {
+    if (pos >= n) return 0;
     uint8_t b0 = (uint8_t)s[pos++];
 
     if (b0 < 0x80u) return b0;
 
     if ((b0 & 0xE0u) == 0xC0u) {
-        if (pos >= s.size()) return 0xFFFDu;
+        if (pos >= n) return 0xFFFDu;
         uint8_t b1 = (uint8_t)s[pos++];
         if (!is_cont(b1)) return 0xFFFDu;
         uint32_t cp = ((uint32_t)(b0 & 0x1Fu) << 6) | (uint32_t)(b1 & 0x3Fu);
@@ -51,7 +150,7 @@ static uint32_t utf8_next(const std::string& s, size_t& pos) {
     }
 
     if ((b0 & 0xF0u) == 0xE0u) {
-        if (pos + 1 >= s.size()) { pos = s.size(); return 0xFFFDu; }
+        if (pos + 1 >= n) { pos = n; return 0xFFFDu; }
         uint8_t b1 = (uint8_t)s[pos++];
         uint8_t b2 = (uint8_t)s[pos++];
         if (!is_cont(b1) || !is_cont(b2)) return 0xFFFDu;
@@ -62,7 +161,7 @@ static uint32_t utf8_next(const std::string& s, size_t& pos) {
     }
 
     if ((b0 & 0xF8u) == 0xF0u) {
-        if (pos + 2 >= s.size()) { pos = s.size(); return 0xFFFDu; }
+        if (pos + 2 >= n) { pos = n; return 0xFFFDu; }
         uint8_t b1 = (uint8_t)s[pos++];
         uint8_t b2 = (uint8_t)s[pos++];
         uint8_t b3 = (uint8_t)s[pos++];
@@ -99,62 +198,584 @@ struct Stats {
     uint64_t tokens = 0;
     uint64_t token_chars = 0;
     uint64_t text_bytes = 0;
+
+    void add(const Stats& o) {
+        docs_with_field += o.docs_with_field;
+        tokens += o.tokens;
+        token_chars += o.token_chars;
+        text_bytes += o.text_bytes;
+    }
+};
+
+static const size_t kOutFlushBytes = (size_t)1 << 20;
+
+// Документы режутся на пачки одинаково в однопоточном и параллельном режимах:
+// граница пачки — это и граница блока бинарного потока, поэтому вывод
+// не зависит от --threads.
+static const size_t kBatchBytes = (size_t)1 << 20;
+static const size_t kBatchDocs = 4096;
+
+// Бинарный поток токенов (--format bin) — формат IRTK, см. token_stream.h.
+enum class TokenFormat { Text, Bin };
+
+// Интернирование термов (--emit_ids): открытая адресация с линейным
+// пробированием по 32-битным id, байты термов лежат подряд в одной арене.
+// Каждая пачка в параллельном режиме интернирует в свою таблицу без
+// блокировок, а главный поток переводит локальные id в глобальные в порядке
+// пачек — id детерминированы и совпадают с однопоточным прогоном.
+static inline uint64_t hash_bytes(const char* p, size_t n) {
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ (uint64_t)n;
+    while (n >= 8) {
+        uint64_t w;
+        std::memcpy(&w, p, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+        p += 8;
+        n -= 8;
+    }
+    uint64_t w = 0;
+    std::memcpy(&w, p, n);
+    h = (h ^ w) * 0xC4CEB9FE1A85EC53ull;
+    return h ^ (h >> 29);
+}
+
+struct TermTable {
+    std::vector<uint32_t> slots;
+    std::vector<uint32_t> hashes;
+    std::vector<uint64_t> offs = std::vector<uint64_t>(1, 0);
+    std::string arena;
+
+    size_t size() const { return hashes.size(); }
+
+    const char* term(uint32_t id, size_t& len) const {
+        len = (size_t)(offs[id + 1] - offs[id]);
+        return arena.data() + offs[id];
+    }
+
+    void clear() {
+        slots.clear();
+        hashes.clear();
+        offs.assign(1, 0);
+        arena.clear();
+    }
+
+    void rehash(size_t cap) {
+        slots.assign(cap, 0);
+        for (uint32_t id = 0; id < (uint32_t)hashes.size(); id++) {
+            size_t k = hashes[id] & (cap - 1);
+            while (slots[k]) k = (k + 1) & (cap - 1);
+            slots[k] = id + 1;
+        }
+    }
+
+    uint32_t intern(const char* p, size_t n) {
+        if ((hashes.size() + 1) * 2 > slots.size()) rehash(slots.empty() ? 1024 : slots.size() * 2);
+        uint32_t h = (uint32_t)hash_bytes(p, n);
+        size_t mask = slots.size() - 1;
+        for (size_t k = h & mask; ; k = (k + 1) & mask) {
+            uint32_t s = slots[k];
+            if (!s) {
+                uint32_t id = (uint32_t)hashes.size();
+                slots[k] = id + 1;
+                hashes.push_back(h);
+                arena.append(p, n);
+                offs.push_back(arena.size());
+                return id;
+            }
+            uint32_t id = s - 1;
+            if (hashes[id] == h && offs[id + 1] - offs[id] == n &&
+                std::memcmp(arena.data() + offs[id], p, n) == 0) return id;
+        }
+    }
+};
+
+struct DocCount {
+    uint32_t tokens = 0;
+    uint32_t bytes = 0;
+};
+
+struct TokenOut {
+    bool enabled = false;
+    bool with_docid = false;
+    bool fold = false;
+    TokenFormat format = TokenFormat::Text;
+    std::string buf;
+
+    std::string block;
+    uint32_t block_tokens = 0;
+    uint32_t block_docs = 0;
+    uint64_t last_docid = 0;
+
+    // Байтовые смещения в тексте поля пишутся дельтами от предыдущего токена
+    // того же поля документа.
+    bool offsets = false;
+    uint64_t prev_off = 0;
+
+    // Несколько полей (--fields): id поля текущего токена, 0 — основное --field.
+    bool fields = false;
+    uint32_t field = 0;
+
+    TermTable* terms = nullptr;
+    std::string ids;
+    std::string scratch;
+
+    // Число токенов и байт каждого документа (для --manifest и --docs).
+    bool count_docs = false;
+    std::vector<DocCount> doc_counts;
+};
+
+struct IndexSink;
+
+struct Outputs {
+    IndexSink* index = nullptr;
+    FILE* tokens = nullptr;
+    FILE* ids = nullptr;
+    TermTable* vocab = nullptr;
+    std::vector<DocCount>* doc_counts = nullptr;
 };
 
-static void flush_token(FILE* out, bool with_docid, uint64_t docid,
-                        const std::string& token, uint64_t token_len_base,
+static void append_u64(std::string& out, uint64_t v) {
+    char tmp[24];
+    int n = 0;
+    do { tmp[n++] = (char)('0' + v % 10); v /= 10; } while (v);
+    while (n) out.push_back(tmp[--n]);
+}
+
+static void append_u32_le(std::string& out, uint32_t v) {
+    char b[4] = {(char)(v & 0xFFu), (char)((v >> 8) & 0xFFu), (char)((v >> 16) & 0xFFu), (char)(v >> 24)};
+    out.append(b, 4);
+}
+
+static void append_u64_le(std::string& out, uint64_t v) {
+    append_u32_le(out, (uint32_t)v);
+    append_u32_le(out, (uint32_t)(v >> 32));
+}
+
+static void append_varint(std::string& out, uint64_t v) {
+    while (v >= 0x80u) {
+        out.push_back((char)(v | 0x80u));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static void write_stream_header(FILE* f, const char* magic, uint32_t flags) {
+    std::string h(magic, 4);
+    append_u32_le(h, kTokStreamVersion);
+    append_u32_le(h, flags);
+    append_u32_le(h, 0);
+    std::fwrite(h.data(), 1, h.size(), f);
+}
+
+static void end_block(TokenOut& out) {
+    if (out.block_tokens == 0) return;
+    append_u32_le(out.buf, out.block_tokens);
+    append_u32_le(out.buf, out.block_docs);
+    append_u32_le(out.buf, (uint32_t)out.block.size());
+    out.buf.append(out.block);
+    out.block.clear();
+    out.block_tokens = 0;
+    out.block_docs = 0;
+    out.last_docid = 0;
+}
+
+static void write_out(FILE* f, std::string& buf) {
+    if (f && !buf.empty()) std::fwrite(buf.data(), 1, buf.size(), f);
+    buf.clear();
+}
+
+// Словарь (--vocab), формат IRVC — см. token_stream.h.
+static void write_vocab(const char* path, const TermTable& t, uint32_t flags) {
+    FILE* f = std::fopen(path, "wb");
+    if (!f) die("Не удалось открыть файл словаря");
+    std::string buf("IRVC", 4);
+    append_u32_le(buf, kTokStreamVersion);
+    append_u32_le(buf, flags);
+    append_u32_le(buf, (uint32_t)t.size());
+    for (uint32_t id = 0; id < (uint32_t)t.size(); id++) {
+        size_t len;
+        const char* p = t.term(id, len);
+        append_u32_le(buf, (uint32_t)len);
+        buf.append(p, len);
+        if (buf.size() >= kOutFlushBytes) write_out(f, buf);
+    }
+    write_out(f, buf);
+    std::fclose(f);
+}
+
+// Перевод локальных id пачки в глобальные (в порядке первого появления).
+static void remap_ids(std::string& ids, const TermTable& local, TermTable& global) {
+    std::vector<uint32_t> map(local.size());
+    for (uint32_t id = 0; id < (uint32_t)local.size(); id++) {
+        size_t len;
+        const char* p = local.term(id, len);
+        map[id] = global.intern(p, len);
+    }
+    for (size_t k = 4; k + 4 <= ids.size(); k += 8) {
+        uint32_t v;
+        std::memcpy(&v, &ids[k], 4);
+        v = map[v];
+        std::memcpy(&ids[k], &v, 4);
+    }
+}
+
+static void append_token(std::string& dst, const TokenOut& out, const char* tok, size_t len) {
+    if (!out.fold) { dst.append(tok, len); return; }
+    size_t o = dst.size();
+    dst.resize(o + len);
+    fold_bytes(&dst[o], tok, len);
+}
+
+static void flush_token(TokenOut& out, uint64_t docid, uint64_t off,
+                        const char* tok, size_t len, uint64_t token_len_base,
                         Stats& st) {
     st.tokens++;
     st.token_chars += token_len_base;
-    if (out) {
-        if (with_docid) std::fprintf(out, "%llu\t", (unsigned long long)docid);
-        std::fwrite(token.data(), 1, token.size(), out);
-        std::fputc('\n', out);
+    if (out.terms) {
+        const char* t = tok;
+        if (out.fold) {
+            out.scratch.resize(len);
+            fold_bytes(&out.scratch[0], tok, len);
+            t = out.scratch.data();
+        }
+        append_u32_le(out.ids, (uint32_t)docid);
+        append_u32_le(out.ids, out.terms->intern(t, len));
+    }
+    if (!out.enabled) return;
+    if (out.format == TokenFormat::Bin) {
+        if (out.block_tokens == 0 || docid != out.last_docid) out.block_docs++;
+        append_varint(out.block, docid - out.last_docid);
+        if (out.fields) append_varint(out.block, out.field);
+        if (out.offsets) append_varint(out.block, off - out.prev_off);
+        append_varint(out.block, len);
+        out.prev_off = off;
+        append_token(out.block, out, tok, len);
+        out.block_tokens++;
+        out.last_docid = docid;
+        return;
+    }
+    if (out.with_docid) { append_u64(out.buf, docid); out.buf.push_back('\t'); }
+    append_token(out.buf, out, tok, len);
+    if (out.fields) { out.buf.push_back('\t'); append_u64(out.buf, out.field); }
+    out.buf.push_back('\n');
+}
+
+
+
+// Быстрый путь токенизатора. token_run возвращает длину префикса, целиком
+// состоящего из «простых» символов токена: ASCII-букв/цифр и двухбайтовых
+// U+0400..U+04FF (ведущий байт D0..D3 + продолжение); в pairs — сколько там
+// двухбайтовых символов. sep_run — длина префикса из ASCII-разделителей.
+// Всё остальное (прочая кириллица, диакритика, дефис, битый UTF-8) разбирает
+// скалярный цикл, поэтому правила токенизации от ядра не зависят.
+static inline bool is_ascii_alnum(uint8_t b) {
+    return (b >= '0' && b <= '9') || ((uint8_t)(b | 0x20u) >= 'a' && (uint8_t)(b | 0x20u) <= 'z');
+}
+
+static size_t token_run_scalar(const char* p, size_t n, size_t& pairs) {
+    size_t i = 0;
+    while (i < n) {
+        uint8_t b = (uint8_t)p[i];
+        if (is_ascii_alnum(b)) { i++; continue; }
+        if ((b & 0xFCu) == 0xD0u && i + 1 < n && is_cont((uint8_t)p[i+1])) { i += 2; pairs++; continue; }
+        break;
+    }
+    return i;
+}
+
+static size_t sep_run_scalar(const char* p, size_t n) {
+    size_t i = 0;
+    while (i < n && (uint8_t)p[i] < 0x80u && !is_ascii_alnum((uint8_t)p[i])) i++;
+    return i;
+}
+
+// Первая стадия сканера JSON (в духе simdjson): для каждого 64-байтного блока
+// строятся битовые маски кавычек, обратных слэшей и символов, допустимых
+// после '\\' ("\\/bfnrtu, hex-цифры для \\uXXXX).
+struct RawMasks {
+    uint64_t quote = 0;
+    uint64_t bslash = 0;
+    uint64_t esc_ok = 0;
+    uint64_t is_u = 0;
+    uint64_t hex = 0;
+};
+
+static inline bool is_esc_char(uint8_t b) {
+    return b=='"' || b=='\\' || b=='/' || b=='b' || b=='f' || b=='n' || b=='r' || b=='t' || b=='u';
+}
+
+static void classify64_scalar(const char* p, RawMasks& m) {
+    m = RawMasks();
+    for (int k = 0; k < 64; k++) {
+        uint8_t b = (uint8_t)p[k];
+        uint64_t bit = 1ull << k;
+        if (b == '"') m.quote |= bit;
+        if (b == '\\') m.bslash |= bit;
+        if (is_esc_char(b)) m.esc_ok |= bit;
+        if (b == 'u') m.is_u |= bit;
+        if (hexval((char)b) >= 0) m.hex |= bit;
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LR3_HAVE_X86_KERNELS 1
+
+// Пара «ведущий + продолжение» не может начинаться в последнем байте блока:
+// для него нет бита продолжения, и такой символ уходит в следующий блок.
+static inline bool block_run(uint32_t alnum, uint32_t lead, uint32_t cont,
+                             uint32_t full, size_t& run, size_t& pairs) {
+    uint32_t lp = lead & (cont >> 1);
+    uint32_t simple = (alnum | lp | (lp << 1)) & full;
+    if (simple == full) { pairs += (size_t)__builtin_popcount(lp); return true; }
+    run = (size_t)__builtin_ctz(~simple);
+    pairs += (size_t)__builtin_popcount(lp & ((1u << run) - 1u));
+    return false;
+}
+
+__attribute__((target("avx2")))
+static size_t token_run_avx2(const char* p, size_t n, size_t& pairs) {
+    const __m256i c0  = _mm256_set1_epi8('0' - 1), c9 = _mm256_set1_epi8('9' + 1);
+    const __m256i ca  = _mm256_set1_epi8('a' - 1), cz = _mm256_set1_epi8('z' + 1);
+    const __m256i x20 = _mm256_set1_epi8(0x20);
+    const __m256i xFC = _mm256_set1_epi8((char)0xFC), xD0 = _mm256_set1_epi8((char)0xD0);
+    const __m256i xC0 = _mm256_set1_epi8((char)0xC0), x80 = _mm256_set1_epi8((char)0x80);
+    size_t i = 0;
+    while (i + 32 <= n) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i lo = _mm256_or_si256(v, x20);
+        __m256i dig = _mm256_and_si256(_mm256_cmpgt_epi8(v, c0), _mm256_cmpgt_epi8(c9, v));
+        __m256i let = _mm256_and_si256(_mm256_cmpgt_epi8(lo, ca), _mm256_cmpgt_epi8(cz, lo));
+        uint32_t alnum = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(dig, let));
+        uint32_t lead  = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v, xFC), xD0));
+        uint32_t cont  = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v, xC0), x80));
+        size_t run;
+        if (!block_run(alnum, lead, cont, 0xFFFFFFFFu, run, pairs)) return i + run;
+        i += 32;
+    }
+    return i + token_run_scalar(p + i, n - i, pairs);
+}
+
+__attribute__((target("avx2")))
+static size_t sep_run_avx2(const char* p, size_t n) {
+    const __m256i c0  = _mm256_set1_epi8('0' - 1), c9 = _mm256_set1_epi8('9' + 1);
+    const __m256i ca  = _mm256_set1_epi8('a' - 1), cz = _mm256_set1_epi8('z' + 1);
+    const __m256i x20 = _mm256_set1_epi8(0x20);
+    size_t i = 0;
+    while (i + 32 <= n) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i lo = _mm256_or_si256(v, x20);
+        __m256i dig = _mm256_and_si256(_mm256_cmpgt_epi8(v, c0), _mm256_cmpgt_epi8(c9, v));
+        __m256i let = _mm256_and_si256(_mm256_cmpgt_epi8(lo, ca), _mm256_cmpgt_epi8(cz, lo));
+        uint32_t stop = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(dig, let), v));
+        if (stop) return i + (size_t)__builtin_ctz(stop);
+        i += 32;
+    }
+    return i + sep_run_scalar(p + i, n - i);
+}
+
+__attribute__((target("sse4.2")))
+static size_t token_run_sse42(const char* p, size_t n, size_t& pairs) {
+    const __m128i c0  = _mm_set1_epi8('0' - 1), c9 = _mm_set1_epi8('9' + 1);
+    const __m128i ca  = _mm_set1_epi8('a' - 1), cz = _mm_set1_epi8('z' + 1);
+    const __m128i x20 = _mm_set1_epi8(0x20);
+    const __m128i xFC = _mm_set1_epi8((char)0xFC), xD0 = _mm_set1_epi8((char)0xD0);
+    const __m128i xC0 = _mm_set1_epi8((char)0xC0), x80 = _mm_set1_epi8((char)0x80);
+    size_t i = 0;
+    while (i + 16 <= n) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i lo = _mm_or_si128(v, x20);
+        __m128i dig = _mm_and_si128(_mm_cmpgt_epi8(v, c0), _mm_cmpgt_epi8(c9, v));
+        __m128i let = _mm_and_si128(_mm_cmpgt_epi8(lo, ca), _mm_cmpgt_epi8(cz, lo));
+        uint32_t alnum = (uint32_t)_mm_movemask_epi8(_mm_or_si128(dig, let));
+        uint32_t lead  = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, xFC), xD0));
+        uint32_t cont  = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, xC0), x80));
+        size_t run;
+        if (!block_run(alnum, lead, cont, 0xFFFFu, run, pairs)) return i + run;
+        i += 16;
+    }
+    return i + token_run_scalar(p + i, n - i, pairs);
+}
+
+__attribute__((target("sse4.2")))
+static size_t sep_run_sse42(const char* p, size_t n) {
+    const __m128i c0  = _mm_set1_epi8('0' - 1), c9 = _mm_set1_epi8('9' + 1);
+    const __m128i ca  = _mm_set1_epi8('a' - 1), cz = _mm_set1_epi8('z' + 1);
+    const __m128i x20 = _mm_set1_epi8(0x20);
+    size_t i = 0;
+    while (i + 16 <= n) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        __m128i lo = _mm_or_si128(v, x20);
+        __m128i dig = _mm_and_si128(_mm_cmpgt_epi8(v, c0), _mm_cmpgt_epi8(c9, v));
+        __m128i let = _mm_and_si128(_mm_cmpgt_epi8(lo, ca), _mm_cmpgt_epi8(cz, lo));
+        uint32_t stop = (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(dig, let), v));
+        if (stop) return i + (size_t)__builtin_ctz(stop);
+        i += 16;
+    }
+    return i + sep_run_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline void classify32_avx2(const char* p, uint32_t* out5) {
+    const __m256i c0 = _mm256_set1_epi8('0' - 1), c9 = _mm256_set1_epi8('9' + 1);
+    const __m256i ca = _mm256_set1_epi8('a' - 1), cf = _mm256_set1_epi8('f' + 1);
+    const __m256i x20 = _mm256_set1_epi8(0x20);
+    __m256i v = _mm256_loadu_si256((const __m256i*)p);
+    __m256i lo = _mm256_or_si256(v, x20);
+    __m256i q  = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'));
+    __m256i bs = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'));
+    __m256i u  = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('u'));
+    __m256i ok = _mm256_or_si256(_mm256_or_si256(q, bs), u);
+    ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+    ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('b')));
+    ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('f')));
+    ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('n')));
+    ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('r')));
+    ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('t')));
+    __m256i dig = _mm256_and_si256(_mm256_cmpgt_epi8(v, c0), _mm256_cmpgt_epi8(c9, v));
+    __m256i af  = _mm256_and_si256(_mm256_cmpgt_epi8(lo, ca), _mm256_cmpgt_epi8(cf, lo));
+    out5[0] = (uint32_t)_mm256_movemask_epi8(q);
+    out5[1] = (uint32_t)_mm256_movemask_epi8(bs);
+    out5[2] = (uint32_t)_mm256_movemask_epi8(ok);
+    out5[3] = (uint32_t)_mm256_movemask_epi8(u);
+    out5[4] = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(dig, af));
+}
+
+__attribute__((target("avx2")))
+static void classify64_avx2(const char* p, RawMasks& m) {
+    uint32_t a[5], b[5];
+    classify32_avx2(p, a);
+    classify32_avx2(p + 32, b);
+    m.quote  = (uint64_t)a[0] | ((uint64_t)b[0] << 32);
+    m.bslash = (uint64_t)a[1] | ((uint64_t)b[1] << 32);
+    m.esc_ok = (uint64_t)a[2] | ((uint64_t)b[2] << 32);
+    m.is_u   = (uint64_t)a[3] | ((uint64_t)b[3] << 32);
+    m.hex    = (uint64_t)a[4] | ((uint64_t)b[4] << 32);
+}
+
+__attribute__((target("sse4.2")))
+static inline void classify16_sse42(const char* p, uint32_t* out5) {
+    const __m128i c0 = _mm_set1_epi8('0' - 1), c9 = _mm_set1_epi8('9' + 1);
+    const __m128i ca = _mm_set1_epi8('a' - 1), cf = _mm_set1_epi8('f' + 1);
+    const __m128i x20 = _mm_set1_epi8(0x20);
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    __m128i lo = _mm_or_si128(v, x20);
+    __m128i q  = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+    __m128i bs = _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'));
+    __m128i u  = _mm_cmpeq_epi8(v, _mm_set1_epi8('u'));
+    __m128i ok = _mm_or_si128(_mm_or_si128(q, bs), u);
+    ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+    ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('b')));
+    ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('f')));
+    ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('n')));
+    ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('r')));
+    ok = _mm_or_si128(ok, _mm_cmpeq_epi8(v, _mm_set1_epi8('t')));
+    __m128i dig = _mm_and_si128(_mm_cmpgt_epi8(v, c0), _mm_cmpgt_epi8(c9, v));
+    __m128i af  = _mm_and_si128(_mm_cmpgt_epi8(lo, ca), _mm_cmpgt_epi8(cf, lo));
+    out5[0] = (uint32_t)_mm_movemask_epi8(q);
+    out5[1] = (uint32_t)_mm_movemask_epi8(bs);
+    out5[2] = (uint32_t)_mm_movemask_epi8(ok);
+    out5[3] = (uint32_t)_mm_movemask_epi8(u);
+    out5[4] = (uint32_t)_mm_movemask_epi8(_mm_or_si128(dig, af));
+}
+
+__attribute__((target("sse4.2")))
+static void classify64_sse42(const char* p, RawMasks& m) {
+    m = RawMasks();
+    for (int k = 0; k < 4; k++) {
+        uint32_t a[5];
+        classify16_sse42(p + 16 * k, a);
+        m.quote  |= (uint64_t)a[0] << (16 * k);
+        m.bslash |= (uint64_t)a[1] << (16 * k);
+        m.esc_ok |= (uint64_t)a[2] << (16 * k);
+        m.is_u   |= (uint64_t)a[3] << (16 * k);
+        m.hex    |= (uint64_t)a[4] << (16 * k);
     }
 }
+#endif
+
+struct TokKernels {
+    const char* name;
+    size_t (*token_run)(const char*, size_t, size_t&);
+    size_t (*sep_run)(const char*, size_t);
+    void (*classify64)(const char*, RawMasks&);
+};
+
+static TokKernels g_kernels = {"scalar", token_run_scalar, sep_run_scalar, classify64_scalar};
+
+static bool select_kernels(const std::string& want) {
+    std::string w = want;
+#ifdef LR3_HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    bool has_avx2 = __builtin_cpu_supports("avx2");
+    bool has_sse42 = __builtin_cpu_supports("sse4.2");
+    if (w == "auto") w = has_avx2 ? "avx2" : (has_sse42 ? "sse42" : "scalar");
+    if (w == "avx2" && has_avx2) { g_kernels = {"avx2", token_run_avx2, sep_run_avx2, classify64_avx2}; return true; }
+    if (w == "sse42" && has_sse42) { g_kernels = {"sse42", token_run_sse42, sep_run_sse42, classify64_sse42}; return true; }
+#else
+    if (w == "auto") w = "scalar";
+#endif
+    if (w == "scalar") { g_kernels = {"scalar", token_run_scalar, sep_run_scalar, classify64_scalar}; return true; }
+    return false;
+}
 
 
 
-static void tokenize_text_utf8_emit(const std::string& text, Stats& st,
-                                    FILE* out, bool with_docid, uint64_t docid) {
-    st.text_bytes += (uint64_t)text.size();
+// Токены пишутся срезами (ptr, len) прямо из src, без промежуточных строк.
+static void tokenize_text_utf8_emit(std::string_view src, Stats& st,
+                                    TokenOut& out, uint64_t docid) {
+    const char* text = src.data();
+    const size_t n = src.size();
+    st.text_bytes += (uint64_t)n;
+    out.prev_off = 0;
 
     bool in_tok = false;
     bool last_was_hyphen = false;
     uint64_t cur_len_base = 0;
-    std::string token;
-    token.reserve(32);
+    size_t tok_start = 0;
+
+    for (size_t pos = 0; pos < n; ) {
+        if (!in_tok) {
+            pos += g_kernels.sep_run(text + pos, n - pos);
+            if (pos >= n) break;
+        }
+
+        size_t pairs = 0;
+        size_t run = g_kernels.token_run(text + pos, n - pos, pairs);
+        if (run) {
+            if (!in_tok) {
+                in_tok = true;
+                cur_len_base = 0;
+                tok_start = pos;
+            }
+            pos += run;
+            cur_len_base += run - pairs;
+            last_was_hyphen = false;
+            if (pos >= n) break;
+        }
 
-    for (size_t pos = 0; pos < text.size(); ) {
         size_t cp_start = pos;
-        uint32_t cp = utf8_next(text, pos);
+        uint32_t cp = utf8_next(text, n, pos);
 
         if (is_token_base(cp)) {
             if (!in_tok) {
                 in_tok = true;
-                last_was_hyphen = false;
                 cur_len_base = 0;
-                token.clear();
+                tok_start = cp_start;
             }
-            token.append(text.data() + cp_start, pos - cp_start);
             cur_len_base++;
             last_was_hyphen = false;
             continue;
         }
 
-        
-        if (in_tok && is_combining_mark(cp)) {
-            token.append(text.data() + cp_start, pos - cp_start);
-            continue;
-        }
+        if (in_tok && is_combining_mark(cp)) continue;
 
         if (cp == (uint32_t)'-') {
             if (in_tok && !last_was_hyphen) {
                 size_t p2 = pos;
-                if (p2 < text.size()) {
-                    uint32_t nextcp = utf8_next(text, p2);
+                if (p2 < n) {
+                    uint32_t nextcp = utf8_next(text, n, p2);
                     if (is_token_base(nextcp)) {
-                        token.push_back('-');
                         last_was_hyphen = true;
                         continue;
                     }
@@ -163,28 +784,35 @@ static void tokenize_text_utf8_emit(const std::string& text, Stats& st,
         }
 
         if (in_tok) {
-            flush_token(out, with_docid, docid, token, cur_len_base, st);
+            flush_token(out, docid, tok_start, text + tok_start, cp_start - tok_start, cur_len_base, st);
             in_tok = false;
             last_was_hyphen = false;
             cur_len_base = 0;
-            token.clear();
         }
     }
 
     if (in_tok) {
-        flush_token(out, with_docid, docid, token, cur_len_base, st);
+        flush_token(out, docid, tok_start, text + tok_start, n - tok_start, cur_len_base, st);
     }
 }
 
+// Дополнительные поля документа (--fields) получают id 1..count.
+static void tokenize_extras(const std::string* extras, size_t count, Stats& st,
+                            TokenOut& out, uint64_t docid) {
+    for (size_t k = 0; k < count; k++) {
+        out.field = (uint32_t)(k + 1);
+        tokenize_text_utf8_emit(extras[k], st, out, docid);
+    }
+    out.field = 0;
+}
 
-
-static int hexval(char c) {
-    if (c >= '0' && c <= '9') return c - '0';
-    if (c >= 'a' && c <= 'f') return 10 + (c - 'a');
-    if (c >= 'A' && c <= 'F') return 10 + (c - 'A');
-    return -1;
+static void count_doc(TokenOut& out, const Stats& st, uint64_t tokens_before, size_t bytes) {
+    if (out.count_docs) out.doc_counts.push_back({(uint32_t)(st.tokens - tokens_before), (uint32_t)bytes});
 }
 
+
+
+
 static void append_utf8(std::string& out, uint32_t cp) {
     if (cp <= 0x7Fu) {
         out.push_back((char)cp);
@@ -203,15 +831,15 @@ static void append_utf8(std::string& out, uint32_t cp) {
     }
 }
 
-static bool parse_json_string_relaxed(const std::string& s, size_t& i, std::string& out) {
+static bool parse_json_string_relaxed(const char* s, size_t n, size_t& i, std::string& out) {
     out.clear();
-    if (i >= s.size() || s[i] != '"') return false;
+    if (i >= n || s[i] != '"') return false;
     i++;
-    while (i < s.size()) {
+    while (i < n) {
         char c = s[i++];
         if (c == '"') return true;
         if (c == '\\') {
-            if (i >= s.size()) return false;
+            if (i >= n) return false;
             char e = s[i++];
             switch (e) {
                 case '"': out.push_back('"'); break;
@@ -223,14 +851,14 @@ static bool parse_json_string_relaxed(const std::string& s, size_t& i, std::stri
                 case 'r': out.push_back('\r'); break;
                 case 't': out.push_back('\t'); break;
                 case 'u': {
-                    if (i + 3 >= s.size()) return false;
+                    if (i + 3 >= n) return false;
                     int v1 = hexval(s[i]), v2 = hexval(s[i+1]), v3 = hexval(s[i+2]), v4 = hexval(s[i+3]);
                     if (v1<0 || v2<0 || v3<0 || v4<0) return false;
                     uint32_t u = (uint32_t)((v1<<12) | (v2<<8) | (v3<<4) | v4);
                     i += 4;
 
                     if (u >= 0xD800u && u <= 0xDBFFu) {
-                        if (i + 5 < s.size() && s[i] == '\\' && s[i+1] == 'u') {
+                        if (i + 5 < n && s[i] == '\\' && s[i+1] == 'u') {
                             i += 2;
                             int w1 = hexval(s[i]), w2 = hexval(s[i+1]), w3 = hexval(s[i+2]), w4 = hexval(s[i+3]);
                             if (w1<0 || w2<0 || w3<0 || w4<0) { append_utf8(out, 0xFFFDu); i += 4; break; }
@@ -251,62 +879,1268 @@ static bool parse_json_string_relaxed(const std::string& s, size_t& i, std::stri
                     return false;
             }
         } else {
-            out.push_back(c);
+            size_t r = i;
+            while (r < n && s[r] != '"' && s[r] != '\\') r++;
+            out.append(s + i - 1, r - i + 1);
+            i = r;
         }
     }
     return false;
 }
 
+// Строка JSON в позиции i как view: без escape-последовательностей — срез
+// самой выгрузки, иначе декодированное значение в arena (её ёмкость
+// переиспользуется, так что в установившемся режиме выделений нет).
+static std::string_view json_string_view(const char* s, size_t n, size_t i, std::string& arena) {
+    if (i < n && s[i] == '"') {
+        const char* q = (const char*)std::memchr(s + i + 1, '"', n - i - 1);
+        if (q && !std::memchr(s + i + 1, '\\', (size_t)(q - s) - i - 1))
+            return std::string_view(s + i + 1, (size_t)(q - s) - i - 1);
+    }
+    parse_json_string_relaxed(s, n, i, arena);
+    return arena;
+}
+
+
+
+static bool skip_json_string_relaxed(const char* s, size_t n, size_t& i) {
+    if (i >= n || s[i] != '"') return false;
+    i++;
+    while (i < n) {
+        char c = s[i++];
+        if (c == '"') return true;
+        if (c != '\\') continue;
+        if (i >= n) return false;
+        char e = s[i++];
+        switch (e) {
+            case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+                break;
+            case 'u': {
+                if (i + 3 >= n) return false;
+                int v1 = hexval(s[i]), v2 = hexval(s[i+1]), v3 = hexval(s[i+2]), v4 = hexval(s[i+3]);
+                if (v1<0 || v2<0 || v3<0 || v4<0) return false;
+                uint32_t u = (uint32_t)((v1<<12) | (v2<<8) | (v3<<4) | v4);
+                i += 4;
+                if (u >= 0xD800u && u <= 0xDBFFu && i + 5 < n && s[i] == '\\' && s[i+1] == 'u') i += 6;
+            } break;
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+
+
+// Вторая стадия: по маскам блока вычисляются экранированные символы
+// (алгоритм simdjson для серий '\'), неэкранированные кавычки и «плохие»
+// позиции — недопустимый символ после '\' или не-hex внутри \uXXXX.
+// Строка без плохих позиций пропускается прыжком к закрывающей кавычке;
+// строки с плохими позициями разбирает скалярный relaxed-парсер, так что
+// поведение на битом JSON не меняется.
+static inline uint64_t find_escaped(uint64_t backslash, uint64_t& prev_escaped) {
+    backslash &= ~prev_escaped;
+    uint64_t follows_escape = (backslash << 1) | prev_escaped;
+    const uint64_t even_bits = 0x5555555555555555ull;
+    uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+    uint64_t seq_on_even;
+    prev_escaped = __builtin_add_overflow(odd_starts, backslash, &seq_on_even) ? 1u : 0u;
+    uint64_t invert = seq_on_even << 1;
+    return (even_bits ^ invert) & follows_escape;
+}
+
+struct StructIndex {
+    const char* data;
+    size_t n;
+
+    size_t blk = SIZE_MAX;
+    uint64_t uquote = 0;
+    uint64_t bslash = 0;
+    uint64_t bad = 0;
+
+    size_t carry_blk = 0;
+    uint64_t esc_carry = 0;
+    uint64_t hex_carry = 0;
+
+    StructIndex(const char* d, size_t sz) : data(d), n(sz) {}
+
+    void compute(size_t b) {
+        RawMasks m;
+        size_t off = b * 64;
+        if (off + 64 <= n) {
+            g_kernels.classify64(data + off, m);
+        } else {
+            char pad[64];
+            std::memset(pad, ' ', sizeof(pad));
+            std::memcpy(pad, data + off, n - off);
+            g_kernels.classify64(pad, m);
+        }
+
+        uint64_t escaped = find_escaped(m.bslash, esc_carry);
+        uint64_t need_hex = hex_carry;
+        uint64_t u = escaped & m.is_u;
+        need_hex |= (u << 1) | (u << 2) | (u << 3) | (u << 4);
+        uint64_t t = u >> 60;
+        hex_carry = t | (t >> 1) | (t >> 2) | (t >> 3);
+
+        blk = b;
+        uquote = m.quote & ~escaped;
+        bslash = m.bslash;
+        bad = (escaped & ~m.esc_ok) | (need_hex & ~m.hex);
+        carry_blk = b + 1;
+    }
+
+    void load(size_t b) {
+        if (b == blk) return;
+        if (b != carry_blk) {
+            hex_carry = 0;
+            esc_carry = 0;
+            if (b > 0) {
+                size_t start = (b - 1) * 64, k = 0;
+                while (k < start && data[start - 1 - k] == '\\') k++;
+                esc_carry = k & 1u;
+                compute(b - 1);
+            }
+        }
+        compute(b);
+    }
+
+    // open — позиция открывающей кавычки. true: close — закрывающая кавычка,
+    // has_bs — были ли внутри экранирования. false: нужен скалярный разбор.
+    bool string_end(size_t open, size_t& close, bool& has_bs) {
+        size_t pos = open + 1;
+        bool any_bs = false;
+        while (pos < n) {
+            size_t b = pos / 64;
+            load(b);
+            uint64_t from = ~0ull << (pos % 64);
+            uint64_t q = uquote & from;
+            uint64_t upto = q ? (q ^ (q - 1)) : ~0ull;
+            uint64_t range = from & upto;
+            if (bad & range) return false;
+            if (bslash & range) any_bs = true;
+            if (q) {
+                close = b * 64 + (size_t)__builtin_ctzll(q);
+                has_bs = any_bs;
+                return true;
+            }
+            pos = (b + 1) * 64;
+        }
+        return false;
+    }
+};
+
+struct FieldScanner {
+    JsonInput& in;
+    const std::string& field;
+    bool release = true;
+    size_t i = 0;
+    std::string key;
+    std::string arena;  // декодированные значения с escape-последовательностями
+    StructIndex sidx;
+
+    // NDJSON (mongoexport): каждая строка — отдельный документ. Из строки
+    // берётся первое значение поля, а строка JSON, не закрытая до перевода
+    // строки, отбрасывает остаток своей строки и не задевает следующую.
+    bool lines = false;
+    size_t line_end = 0;
+
+    size_t find_line_end(size_t p) const {
+        const void* q = std::memchr(in.data + p, '\n', in.size - p);
+        return q ? (size_t)((const char*)q - in.data) : in.size;
+    }
+
+    FieldScanner(JsonInput& in_, const std::string& field_, bool release_)
+        : in(in_), field(field_), release(release_), sidx(in_.data, in_.size) {}
+
+    // Конец строки, начинающейся в позиции open; false — строка не разбирается.
+    bool string_at(size_t open, size_t& close, bool& has_bs) {
+        if (sidx.string_end(open, close, has_bs)) return true;
+        size_t k = open;
+        if (!skip_json_string_relaxed(in.data, in.size, k)) return false;
+        close = k - 1;
+        has_bs = true;
+        return true;
+    }
+
+    // Следующий ключ name левее end; vpos — начало его значения (любого типа).
+    bool find_key(const std::string& name, size_t end, size_t& vpos) {
+        const char* json = in.data;
+        const size_t n = in.size;
+
+        while (i < end) {
+            const void* q = std::memchr(json + i, '"', end - i);
+            if (!q) { i = end; break; }
+            i = (size_t)((const char*)q - json);
+
+            size_t save = i;
+            if (release) in.release_before(save);
+            if (lines && save >= line_end) line_end = find_line_end(save);
+            size_t close;
+            bool has_bs;
+            if (!string_at(save, close, has_bs)) { i = save + 1; continue; }
+            if (lines && close > line_end) { i = line_end; continue; }
+            if (close >= end) { i = end; break; }
+            i = close + 1;
+
+            while (i < end && is_ws(json[i])) i++;
+            if (i >= end || json[i] != ':') continue;
+            i++;
+            while (i < end && is_ws(json[i])) i++;
+
+            bool match;
+            if (!has_bs) {
+                match = (close - save - 1 == name.size()) &&
+                        std::memcmp(json + save + 1, name.data(), name.size()) == 0;
+            } else {
+                size_t k = save;
+                parse_json_string_relaxed(json, n, k, key);
+                match = (key == name);
+            }
+            if (match && i < end) { vpos = i; return true; }
+        }
+        return false;
+    }
+
+    // Следующее строковое значение поля name левее end: [vbeg, vend) вместе с кавычками.
+    // Если val != nullptr, туда кладётся view значения (в выгрузку или в arena,
+    // действителен до следующего вызова), иначе значение только пропускается.
+    bool find(const std::string& name, size_t end, std::string_view* val, size_t& vbeg, size_t& vend) {
+        const char* json = in.data;
+        const size_t n = in.size;
+
+        size_t vpos;
+        while (find_key(name, end, vpos)) {
+            if (json[vpos] != '"') continue;
+            size_t close;
+            bool has_bs;
+            if (!string_at(vpos, close, has_bs)) { i = vpos + 1; continue; }
+            if (lines && close > line_end) { i = line_end; continue; }
+            if (close >= end) { i = end; break; }
+            i = lines ? std::min(line_end + 1, n) : close + 1;
+            if (val) {
+                if (has_bs) {
+                    size_t k = vpos;
+                    parse_json_string_relaxed(json, n, k, arena);
+                    *val = arena;
+                } else {
+                    *val = std::string_view(json + vpos + 1, close - vpos - 1);
+                }
+            }
+            vbeg = vpos;
+            vend = close + 1;
+            return true;
+        }
+        return false;
+    }
+
+    bool find(const std::string& name, size_t end, std::string* val, size_t& vbeg, size_t& vend) {
+        std::string_view v;
+        if (!find(name, end, val ? &v : nullptr, vbeg, vend)) return false;
+        if (val) val->assign(v.data(), v.size());
+        return true;
+    }
+
+    bool next(std::string_view* val, size_t& vbeg, size_t& vend) {
+        return find(field, in.size, val, vbeg, vend);
+    }
+
+    size_t pos() const { return i; }
+    size_t extra_count() const { return 0; }
+    const std::string* extras() const { return nullptr; }
+};
+
+// Инкрементальный режим (--manifest): манифест хранит для каждого url_norm
+// content_hash, docid и диапазон токенов в дельта-потоке своего поколения.
+// Повторный прогон токенизирует только новые и изменившиеся документы (им
+// выдаются новые docid), а docid изменившихся и пропавших уходят в tombstones.
+//   манифест:   "IRMF", u32 version, u32 generation, u64 next_docid, u32 count,
+//               далее u32 len + url, u32 len + hash, u64 docid, u32 generation,
+//               u64 first_token, u32 tokens;
+//   tombstones: "IRTB", u32 version, u32 count, u32 reserved, далее u64 docid.
+static const uint32_t kManifestVersion = 1;
+
+struct ManifestEntry {
+    std::string hash;
+    uint64_t docid = 0;
+    uint32_t gen = 0;
+    uint64_t first_token = 0;
+    uint32_t tokens = 0;
+    bool seen = false;
+};
+
+struct Manifest {
+    uint32_t gen = 0;
+    uint64_t next_docid = 0;
+    std::unordered_map<std::string, ManifestEntry> docs;
+};
+
+static bool load_manifest(const char* path, Manifest& m) {
+    std::string data;
+    if (!read_file_all(path, data)) return false;
+    if (data.size() < 24 || std::memcmp(data.data(), "IRMF", 4) != 0) die("Повреждённый манифест");
+    uint32_t version;
+    std::memcpy(&version, data.data() + 4, 4);
+    if (version != kManifestVersion) die("Неподдерживаемая версия манифеста");
+    size_t p = 8;
+    auto take = [&](void* dst, size_t len) {
+        if (p + len > data.size()) die("Манифест обрезан");
+        std::memcpy(dst, data.data() + p, len);
+        p += len;
+    };
+    auto take_str = [&](std::string& dst) {
+        uint32_t len;
+        take(&len, 4);
+        if (p + len > data.size()) die("Манифест обрезан");
+        dst.assign(data.data() + p, len);
+        p += len;
+    };
+    uint32_t count;
+    take(&m.gen, 4);
+    take(&m.next_docid, 8);
+    take(&count, 4);
+    m.docs.reserve(count);
+    std::string url;
+    for (uint32_t k = 0; k < count; k++) {
+        ManifestEntry e;
+        take_str(url);
+        take_str(e.hash);
+        take(&e.docid, 8);
+        take(&e.gen, 4);
+        take(&e.first_token, 8);
+        take(&e.tokens, 4);
+        m.docs[url] = std::move(e);
+    }
+    return true;
+}
+
+static void save_manifest(const char* path, const Manifest& m) {
+    std::vector<const std::pair<const std::string, ManifestEntry>*> order;
+    order.reserve(m.docs.size());
+    for (const auto& kv : m.docs) order.push_back(&kv);
+    std::sort(order.begin(), order.end(), [](const auto* a, const auto* b) { return a->second.docid < b->second.docid; });
+
+    std::string tmp = std::string(path) + ".tmp";
+    FILE* f = std::fopen(tmp.c_str(), "wb");
+    if (!f) die("Не удалось открыть файл манифеста");
+    std::string buf("IRMF", 4);
+    append_u32_le(buf, kManifestVersion);
+    append_u32_le(buf, m.gen);
+    append_u64_le(buf, m.next_docid);
+    append_u32_le(buf, (uint32_t)order.size());
+    for (const auto* kv : order) {
+        const ManifestEntry& e = kv->second;
+        append_u32_le(buf, (uint32_t)kv->first.size());
+        buf.append(kv->first);
+        append_u32_le(buf, (uint32_t)e.hash.size());
+        buf.append(e.hash);
+        append_u64_le(buf, e.docid);
+        append_u32_le(buf, e.gen);
+        append_u64_le(buf, e.first_token);
+        append_u32_le(buf, e.tokens);
+        if (buf.size() >= kOutFlushBytes) write_out(f, buf);
+    }
+    write_out(f, buf);
+    std::fclose(f);
+    if (std::rename(tmp.c_str(), path) != 0) die("Не удалось записать манифест");
+}
+
+static void save_tombstones(const char* path, std::vector<uint64_t> docids) {
+    std::sort(docids.begin(), docids.end());
+    FILE* f = std::fopen(path, "wb");
+    if (!f) die("Не удалось открыть файл tombstones");
+    std::string buf("IRTB", 4);
+    append_u32_le(buf, 1);
+    append_u32_le(buf, (uint32_t)docids.size());
+    append_u32_le(buf, 0);
+    for (uint64_t d : docids) append_u64_le(buf, d);
+    write_out(f, buf);
+    std::fclose(f);
+}
+
+// Таблица документов (--docs): "IRDT", u32 version, u32 count, u32 reserved,
+// далее для каждого документа u64 docid, u32 len + url_norm, u32 len + source,
+// u64 updated_at, u32 tokens, u32 bytes (длина декодированного поля).
+struct DocMeta {
+    std::string url;
+    std::string hash;
+    std::string source;
+    uint64_t updated_at = 0;
+};
+
+static void save_docs_table(const char* path, uint64_t first_docid,
+                            const std::vector<DocMeta>& docs, const std::vector<DocCount>& counts) {
+    FILE* f = std::fopen(path, "wb");
+    if (!f) die("Не удалось открыть файл таблицы документов");
+    std::string buf("IRDT", 4);
+    append_u32_le(buf, 1);
+    append_u32_le(buf, (uint32_t)docs.size());
+    append_u32_le(buf, 0);
+    for (size_t k = 0; k < docs.size(); k++) {
+        const DocMeta& m = docs[k];
+        DocCount c = k < counts.size() ? counts[k] : DocCount();
+        uint64_t docid = first_docid + k;
+        append_u64_le(buf, docid);
+        append_u32_le(buf, (uint32_t)m.url.size());
+        buf.append(m.url);
+        append_u32_le(buf, (uint32_t)m.source.size());
+        buf.append(m.source);
+        append_u64_le(buf, m.updated_at);
+        append_u32_le(buf, c.tokens);
+        append_u32_le(buf, c.bytes);
+        if (buf.size() >= kOutFlushBytes) write_out(f, buf);
+    }
+    write_out(f, buf);
+    std::fclose(f);
+}
+
+// Целое в позиции p: число, строка из цифр или обёртки mongoexport вида
+// {"$numberLong": "..."}; всё остальное (в т.ч. ISO-даты) — 0.
+static uint64_t parse_json_uint_at(const char* s, size_t n, size_t p) {
+    for (int hops = 0; hops < 4 && p < n && (s[p] == '{' || s[p] == '"'); hops++) {
+        if (s[p] == '{') {
+            const void* q = std::memchr(s + p, ':', std::min(n - p, (size_t)32));
+            if (!q) return 0;
+            p = (size_t)((const char*)q - s) + 1;
+            while (p < n && is_ws(s[p])) p++;
+        } else {
+            p++;
+        }
+    }
+    uint64_t v = 0;
+    while (p < n && s[p] >= '0' && s[p] <= '9') v = v * 10 + (uint64_t)(s[p++] - '0');
+    if (p < n && (s[p] == '-' || s[p] == '.' || s[p] == 'T')) return 0;
+    return v;
+}
+
+// Обходит документы верхнего уровня (объекты в корне или в корневом массиве)
+// и отдаёт значения поля документов, которые нужно токенизировать: всех, или
+// (с манифестом) только новых и изменившихся. Для каждого отданного документа
+// запоминаются url_norm/content_hash и, если нужно, source/updated_at.
+// Без манифеста документ — каждое вхождение поля, найденное так же, как
+// в FieldScanner (в том числе вложенное или вне объектов), а метаданные берутся
+// из охватывающего объекта верхнего уровня, так что docid в --docs/--index/
+// --fields совпадают с обычным прогоном. Манифест ведётся по url_norm, поэтому
+// там документ — объект верхнего уровня и берётся первое вхождение поля.
+struct DocScanner {
+    FieldScanner& fs;
+    Manifest* old = nullptr;
+    bool want_meta = false;
+    bool release = true;
+    size_t i = 0;
+    int depth = 0;
+    int doc_depth = -1;
+    size_t scan = 0;                       // позиция поиска поля (без манифеста)
+    size_t obj_beg = 0, obj_end = 0;       // последний найденный объект
+    size_t meta_obj = SIZE_MAX;            // объект, чьи метаданные лежат в cur
+
+    DocMeta cur;
+    std::vector<DocMeta> fresh;  // в порядке docid
+
+    // --fields: "title" — заголовок из url_norm, иначе строковое поле документа.
+    std::vector<std::string> extra_names;
+    std::vector<std::string> extra_vals;
+    std::vector<uint64_t> tombstones;
+    std::unordered_set<std::string> seen_new;  // новые url_norm этого прогона
+    uint64_t unchanged = 0, added = 0, changed = 0, removed = 0, skipped = 0;
+
+    DocScanner(FieldScanner& fs_, Manifest* old_, bool want_meta_, bool release_)
+        : fs(fs_), old(old_), want_meta(want_meta_), release(release_) {}
+
+    size_t pos() const { return old ? i : std::min(i, scan); }
+    size_t extra_count() const { return extra_names.size(); }
+    const std::string* extras() const { return extra_vals.data(); }
+
+    bool next_object(size_t& ob, size_t& oe) {
+        const char* s = fs.in.data;
+        const size_t n = fs.in.size;
+        if (doc_depth < 0) {
+            while (i < n && is_ws(s[i])) i++;
+            doc_depth = (i < n && s[i] == '[') ? 1 : 0;
+        }
+        while (i < n) {
+            char c = s[i];
+            if (c == '"') {
+                size_t close;
+                bool has_bs;
+                i = fs.string_at(i, close, has_bs) ? close + 1 : i + 1;
+                continue;
+            }
+            if (c == '\n' && fs.lines) depth = 0;
+            else if (c == '{' || c == '[') {
+                if (c == '{' && depth == doc_depth) ob = i;
+                depth++;
+            } else if (c == '}' || c == ']') {
+                if (depth > 0) depth--;
+                if (c == '}' && depth == doc_depth) { oe = ++i; return true; }
+            }
+            i++;
+        }
+        return false;
+    }
+
+    bool field_in(const std::string& name, size_t ob, size_t oe, std::string* val, size_t& vbeg, size_t& vend) {
+        fs.i = ob;
+        return fs.find(name, oe, val, vbeg, vend);
+    }
+
+    // Метаданные документа из объекта [ob, oe); cur.url уже заполнен.
+    void load_meta(size_t ob, size_t oe) {
+        static const std::string kSource = "source", kUpdated = "updated_at";
+        size_t b, e;
+        if (want_meta) {
+            if (!field_in(kSource, ob, oe, &cur.source, b, e)) cur.source.clear();
+            fs.i = ob;
+            cur.updated_at = fs.find_key(kUpdated, oe, b) ? parse_json_uint_at(fs.in.data, oe, b) : 0;
+        }
+        for (size_t k = 0; k < extra_names.size(); k++) {
+            if (extra_names[k] == "title") extra_vals[k] = cur.url.empty() ? std::string() : title_from_url_norm(cur.url);
+            else if (!field_in(extra_names[k], ob, oe, &extra_vals[k], b, e)) extra_vals[k].clear();
+        }
+    }
+
+    // Следующее вхождение поля; метаданные — объекта, в который оно попало.
+    bool next_occurrence(std::string_view* val, size_t& vbeg, size_t& vend) {
+        static const std::string kUrl = "url_norm";
+        fs.i = scan;
+        if (!fs.find(fs.field, fs.in.size, (std::string*)nullptr, vbeg, vend)) return false;
+        scan = fs.i;
+        size_t ob = 0, oe = 0, b, e;
+        while (obj_end <= vbeg && next_object(ob, oe)) { obj_beg = ob; obj_end = oe; }
+        if (obj_beg <= vbeg && vbeg < obj_end) {
+            if (meta_obj != obj_beg) {
+                if (!field_in(kUrl, obj_beg, obj_end, &cur.url, b, e)) cur.url.clear();
+                load_meta(obj_beg, obj_end);
+                meta_obj = obj_beg;
+            }
+        } else if (meta_obj != SIZE_MAX) {
+            cur = DocMeta();
+            for (auto& v : extra_vals) v.clear();
+            meta_obj = SIZE_MAX;
+        }
+        fresh.push_back(cur);
+        if (val) *val = json_string_view(fs.in.data, fs.in.size, vbeg, fs.arena);
+        return true;
+    }
+
+    bool next(std::string_view* val, size_t& vbeg, size_t& vend) {
+        static const std::string kUrl = "url_norm", kHash = "content_hash";
+        if (!old) return next_occurrence(val, vbeg, vend);
+        size_t ob = 0, oe = 0, b, e;
+        while (next_object(ob, oe)) {
+            if (release) fs.in.release_before(ob);
+            if (!field_in(fs.field, ob, oe, (std::string*)nullptr, vbeg, vend)) continue;
+            if (!field_in(kUrl, ob, oe, &cur.url, b, e)) { skipped++; continue; }
+            if (!field_in(kHash, ob, oe, &cur.hash, b, e)) cur.hash.clear();
+            auto it = old->docs.find(cur.url);
+            if (it != old->docs.end()) {
+                if (it->second.seen) { skipped++; continue; }
+                it->second.seen = true;
+                if (!cur.hash.empty() && it->second.hash == cur.hash) { unchanged++; continue; }
+                tombstones.push_back(it->second.docid);
+                changed++;
+            } else {
+                // Повтор нового url_norm пропускается, как и повтор старого:
+                // иначе первый docid остался бы без записи в манифесте.
+                if (!seen_new.insert(cur.url).second) { skipped++; continue; }
+                added++;
+            }
+            load_meta(ob, oe);
+            fresh.push_back(cur);
+            if (val) *val = json_string_view(fs.in.data, fs.in.size, vbeg, fs.arena);
+            return true;
+        }
+        return false;
+    }
+
+    // Новый манифест: встреченные записи старого, поверх них — заново
+    // токенизированные (их диапазоны токенов — в текущем дельта-потоке).
+    void finish(Manifest& next, uint64_t first_docid, const std::vector<DocCount>& counts) {
+        next.gen = old->gen + 1;
+        next.next_docid = first_docid + fresh.size();
+        for (auto& kv : old->docs) {
+            if (kv.second.seen) next.docs[kv.first] = kv.second;
+            else { tombstones.push_back(kv.second.docid); removed++; }
+        }
+        uint64_t tok = 0;
+        for (size_t k = 0; k < fresh.size(); k++) {
+            ManifestEntry e;
+            e.hash = fresh[k].hash;
+            e.docid = first_docid + k;
+            e.gen = next.gen;
+            e.first_token = tok;
+            e.tokens = k < counts.size() ? counts[k].tokens : 0;
+            tok += e.tokens;
+            next.docs[fresh[k].url] = std::move(e);
+        }
+    }
+};
+
+// Слитый режим (--index): id термов из пачек уходят в поток построителя
+// индекса через ограниченную очередь (один производитель — поток записи
+// пачек, один потребитель), промежуточный файл токенов не нужен. Пустая или
+// полная очередь усыпляет сторону на condition_variable. Потребитель сразу
+// раскладывает пары по спискам постингов термов, так что после скана
+// остаётся лишь упорядочить термы. Индекс совпадает с тем, что строит
+// lr6_index из того же потока токенов.
+struct IndexSink {
+    struct TermPostings {
+        std::vector<uint32_t> docs;  // без повторов подряд
+        uint64_t cf = 0;
+        bool sorted = true;
+    };
+
+    static const size_t kMaxQueued = 64;
+    std::mutex mu;
+    std::condition_variable cv_put, cv_get;
+    std::deque<std::string> queue;
+    std::thread th;
+    std::vector<TermPostings> terms;  // по term_id
+    uint32_t max_doc = 0;
+
+    void start() {
+        th = std::thread([this] {
+            std::string chunk;
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> lk(mu);
+                    cv_get.wait(lk, [&] { return !queue.empty(); });
+                    chunk = std::move(queue.front());
+                    queue.pop_front();
+                }
+                cv_put.notify_one();
+                if (chunk.empty()) return;
+                for (size_t k = 0; k + 8 <= chunk.size(); k += 8) {
+                    uint32_t doc, id;
+                    std::memcpy(&doc, &chunk[k], 4);
+                    std::memcpy(&id, &chunk[k + 4], 4);
+                    add(doc, id);
+                }
+            }
+        });
+    }
+
+    void add(uint32_t doc, uint32_t id) {
+        if (id >= terms.size()) terms.resize(std::max<size_t>((size_t)id + 1, terms.size() * 2));
+        TermPostings& t = terms[id];
+        t.cf++;
+        if (t.docs.empty() || t.docs.back() != doc) {
+            if (!t.docs.empty() && doc < t.docs.back()) t.sorted = false;
+            t.docs.push_back(doc);
+        }
+        if (doc > max_doc) max_doc = doc;
+    }
+
+    void push(std::string chunk) {
+        {
+            std::unique_lock<std::mutex> lk(mu);
+            cv_put.wait(lk, [&] { return queue.size() < kMaxQueued; });
+            queue.push_back(std::move(chunk));
+        }
+        cv_get.notify_one();
+    }
+
+    void finish() {
+        push(std::string());
+        th.join();
+    }
+};
+
+static void flush_ids(Outputs& outs, std::string& ids) {
+    if (outs.index && !ids.empty()) {
+        if (outs.ids) outs.index->push(ids);
+        else { outs.index->push(std::move(ids)); ids.clear(); }
+    }
+    write_out(outs.ids, ids);
+}
+
+// Индекс пишется общим IrixWriter (irix.h), как и в lr6_index.
+static void write_index(const char* path, IndexSink& sink, const TermTable& vocab,
+                        const std::vector<DocMeta>& docs, uint32_t meta_flags,
+                        std::chrono::high_resolution_clock::time_point t0) {
+    std::vector<uint32_t> by_term(vocab.size());
+    for (uint32_t id = 0; id < (uint32_t)by_term.size(); id++) by_term[id] = id;
+    auto term_of = [&](uint32_t id) {
+        size_t len;
+        const char* p = vocab.term(id, len);
+        return std::string_view(p, len);
+    };
+    std::sort(by_term.begin(), by_term.end(), [&](uint32_t a, uint32_t b) { return term_of(a) < term_of(b); });
+
+    IrixWriter w;
+    for (uint32_t id : by_term) {
+        if (id >= sink.terms.size() || sink.terms[id].cf == 0) continue;
+        IndexSink::TermPostings& tp = sink.terms[id];
+        if (!tp.sorted) {
+            std::sort(tp.docs.begin(), tp.docs.end());
+            tp.docs.erase(std::unique(tp.docs.begin(), tp.docs.end()), tp.docs.end());
+        }
+        std::string_view t = term_of(id);
+        w.add_term(t.data(), t.size(), tp.docs.data(), (uint32_t)tp.docs.size(), tp.cf);
+        std::vector<uint32_t>().swap(tp.docs);
+    }
+
+    uint32_t docs_count = w.total_tokens ? sink.max_doc + 1 : 0;
+    if (docs.size() > docs_count) docs_count = (uint32_t)docs.size();
+    std::vector<std::string> urls(docs.size());
+    for (size_t d = 0; d < docs.size(); d++) urls[d] = docs[d].url;
+    double build_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+    w.write(path, docs_count, meta_flags, build_ms, urls);
+}
+
+static void log_progress(const Stats& st, std::chrono::high_resolution_clock::time_point t0) {
+    auto t1 = std::chrono::high_resolution_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    double kb = (double)st.text_bytes / 1024.0;
+    double sec = ms / 1000.0;
+    double kbps = (sec > 0.0) ? (kb / sec) : 0.0;
+    double avglen = (st.tokens > 0) ? ((double)st.token_chars / (double)st.tokens) : 0.0;
+
+    std::printf("progress\tdocs=%llu\tkb=%.3f\ttime_ms=%.3f\tkbps=%.3f\ttokens=%llu\tavg_len=%.3f\n",
+        (unsigned long long)st.docs_with_field, kb, ms, kbps,
+        (unsigned long long)st.tokens, avglen);
+}
+
+// Контрольные точки (--checkpoint): после каждых every пачек выходные файлы
+// сбрасываются на диск и рядом атомарно (tmp + rename) пишется снимок —
+// позиция во входе, следующий docid, размеры выходных файлов и счётчики.
+// --resume 1 обрезает выходные файлы до записанных размеров и продолжает
+// сканирование с сохранённой позиции; вывод совпадает с непрерывным прогоном.
+struct Checkpoint {
+    const char* path = nullptr;
+    int every = 64;
+    const char* vocab_path = nullptr;
+    uint32_t flags = 0;
+    std::string format;
+    std::string field;
+
+    uint64_t input_size = 0;
+    uint64_t input_offset = 0;
+    uint64_t next_docid = 0;
+    uint64_t tokens_bytes = 0;
+    uint64_t ids_bytes = 0;
+    Stats st;
+};
+
+static void sync_file(FILE* f) {
+    if (!f) return;
+    std::fflush(f);
+    ::fsync(::fileno(f));
+}
+
+static uint64_t file_pos(FILE* f) {
+    return f ? (uint64_t)std::ftell(f) : 0;
+}
+
+static void save_checkpoint(Checkpoint& ck, const Outputs& outs, uint64_t off, uint64_t docid, const Stats& st) {
+    if (!ck.path) return;
+    sync_file(outs.tokens);
+    sync_file(outs.ids);
+    if (outs.vocab) {
+        std::string tmp = std::string(ck.vocab_path) + ".tmp";
+        write_vocab(tmp.c_str(), *outs.vocab, ck.flags & (kTsFoldCase | kTsFoldYo));
+        if (std::rename(tmp.c_str(), ck.vocab_path) != 0) die("Не удалось записать словарь контрольной точки");
+    }
+
+    ck.input_offset = off;
+    ck.next_docid = docid;
+    ck.tokens_bytes = file_pos(outs.tokens);
+    ck.ids_bytes = file_pos(outs.ids);
+    ck.st = st;
+
+    std::string tmp = std::string(ck.path) + ".tmp";
+    FILE* f = std::fopen(tmp.c_str(), "wb");
+    if (!f) die("Не удалось открыть файл контрольной точки");
+    // Имя поля — с длиной и как есть: в нём могут быть пробелы.
+    std::fprintf(f, "IRCK 2\n");
+    std::fprintf(f, "field %zu ", ck.field.size());
+    std::fwrite(ck.field.data(), 1, ck.field.size(), f);
+    std::fprintf(f, "\nformat %s\nflags %u\n", ck.format.c_str(), ck.flags);
+    std::fprintf(f, "input_size %llu\ninput_offset %llu\nnext_docid %llu\n",
+                 (unsigned long long)ck.input_size, (unsigned long long)ck.input_offset,
+                 (unsigned long long)ck.next_docid);
+    std::fprintf(f, "tokens_bytes %llu\nids_bytes %llu\n",
+                 (unsigned long long)ck.tokens_bytes, (unsigned long long)ck.ids_bytes);
+    std::fprintf(f, "stats %llu %llu %llu %llu\n",
+                 (unsigned long long)st.docs_with_field, (unsigned long long)st.tokens,
+                 (unsigned long long)st.token_chars, (unsigned long long)st.text_bytes);
+    sync_file(f);
+    std::fclose(f);
+    if (std::rename(tmp.c_str(), ck.path) != 0) die("Не удалось записать контрольную точку");
+}
+
+// false — файла нет; несовместимый снимок — ошибка.
+static bool load_checkpoint(Checkpoint& ck) {
+    FILE* f = std::fopen(ck.path, "rb");
+    if (!f) return false;
+    unsigned long long field_len = 0;
+    if (std::fscanf(f, "IRCK 2 field %llu", &field_len) != 1 || std::fgetc(f) != ' ')
+        die("Повреждённый файл контрольной точки");
+    std::string field;
+    if (field_len == ck.field.size()) {
+        field.resize((size_t)field_len);
+        if (std::fread(&field[0], 1, field.size(), f) != field.size()) die("Повреждённый файл контрольной точки");
+    }
+    char format[16] = {0};
+    unsigned flags = 0;
+    unsigned long long v[9];
+    int got = std::fscanf(f, " format %15s flags %u input_size %llu input_offset %llu "
+                             "next_docid %llu tokens_bytes %llu ids_bytes %llu stats %llu %llu %llu %llu",
+                          format, &flags, &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8]);
+    std::fclose(f);
+    if (field_len != ck.field.size() || ck.field != field)
+        die("Контрольная точка записана с другими --field/--format/--fold/--offsets");
+    if (got != 11) die("Повреждённый файл контрольной точки");
+    if (ck.format != format || ck.flags != flags)
+        die("Контрольная точка записана с другими --field/--format/--fold/--offsets");
+    if (ck.input_size != v[0]) die("Вход изменился с момента контрольной точки");
+    ck.input_offset = v[1];
+    ck.next_docid = v[2];
+    ck.tokens_bytes = v[3];
+    ck.ids_bytes = v[4];
+    ck.st.docs_with_field = v[5];
+    ck.st.tokens = v[6];
+    ck.st.token_chars = v[7];
+    ck.st.text_bytes = v[8];
+    return true;
+}
 
+static void load_vocab(const char* path, TermTable& t) {
+    std::string data;
+    if (!read_file_all(path, data) || data.size() < 16 || std::memcmp(data.data(), "IRVC", 4) != 0)
+        die("Не удалось прочитать словарь контрольной точки");
+    uint32_t count;
+    std::memcpy(&count, data.data() + 12, 4);
+    size_t p = 16;
+    for (uint32_t k = 0; k < count; k++) {
+        uint32_t len;
+        if (p + 4 > data.size()) die("Словарь контрольной точки обрезан");
+        std::memcpy(&len, data.data() + p, 4);
+        p += 4;
+        if (p + len > data.size()) die("Словарь контрольной точки обрезан");
+        t.intern(data.data() + p, len);
+        p += len;
+    }
+}
 
-static void process_json_in_memory(const std::string& json,
-                                   const std::string& field,
+template <class Scanner>
+static void process_json_in_memory(Scanner& sc,
                                    int log_every,
-                                   FILE* out,
-                                   bool with_docid,
+                                   Outputs& outs,
+                                   const TokenOut& proto,
+                                   Checkpoint& ck,
                                    Stats& st) {
-    std::string key, val;
-    uint64_t docid = 0;
+    std::string_view val;
+    uint64_t docid = ck.next_docid;
     auto t0 = std::chrono::high_resolution_clock::now();
 
-    size_t i = 0;
-    while (i < json.size()) {
-        if (json[i] != '"') { i++; continue; }
-
-        size_t save = i;
-        if (!parse_json_string_relaxed(json, i, key)) { i = save + 1; continue; }
-
-        while (i < json.size() && is_ws(json[i])) i++;
-        if (i >= json.size() || json[i] != ':') continue;
-        i++;
-        while (i < json.size() && is_ws(json[i])) i++;
-
-        if (key == field && i < json.size() && json[i] == '"') {
-            size_t vpos = i;
-            if (!parse_json_string_relaxed(json, i, val)) { i = vpos + 1; continue; }
-
-            st.docs_with_field++;
-            tokenize_text_utf8_emit(val, st, out, with_docid, docid);
-            docid++;
-
-            if (log_every > 0 && (st.docs_with_field % (uint64_t)log_every) == 0) {
-                auto t1 = std::chrono::high_resolution_clock::now();
-                double ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
-                double kb = (double)st.text_bytes / 1024.0;
-                double sec = ms / 1000.0;
-                double kbps = (sec > 0.0) ? (kb / sec) : 0.0;
-                double avglen = (st.tokens > 0) ? ((double)st.token_chars / (double)st.tokens) : 0.0;
-
-                std::printf("progress\tdocs=%llu\tkb=%.3f\ttime_ms=%.3f\tkbps=%.3f\ttokens=%llu\tavg_len=%.3f\n",
-                    (unsigned long long)st.docs_with_field, kb, ms, kbps,
-                    (unsigned long long)st.tokens, avglen);
+    TokenOut tout = proto;
+    size_t batch_docs = 0, batch_bytes = 0;
+    int batches = 0;
+
+    size_t vbeg, vend;
+    while (sc.next(&val, vbeg, vend)) {
+        st.docs_with_field++;
+        uint64_t tokens_before = st.tokens;
+        tokenize_text_utf8_emit(val, st, tout, docid);
+        tokenize_extras(sc.extras(), sc.extra_count(), st, tout, docid);
+        count_doc(tout, st, tokens_before, val.size());
+        docid++;
+
+        batch_docs++;
+        batch_bytes += vend - vbeg;
+        if (batch_bytes >= kBatchBytes || batch_docs >= kBatchDocs) {
+            end_block(tout);
+            batch_docs = 0;
+            batch_bytes = 0;
+            if (ck.path && ++batches % ck.every == 0) {
+                write_out(outs.tokens, tout.buf);
+                flush_ids(outs, tout.ids);
+                save_checkpoint(ck, outs, sc.pos(), docid, st);
             }
         }
+        if (tout.buf.size() >= kOutFlushBytes) write_out(outs.tokens, tout.buf);
+        if (tout.ids.size() >= kOutFlushBytes) flush_ids(outs, tout.ids);
+
+        if (log_every > 0 && (st.docs_with_field % (uint64_t)log_every) == 0) log_progress(st, t0);
     }
+    end_block(tout);
+    write_out(outs.tokens, tout.buf);
+    flush_ids(outs, tout.ids);
+    if (outs.doc_counts) outs.doc_counts->swap(tout.doc_counts);
+    save_checkpoint(ck, outs, sc.pos(), docid, st);
 }
 
 
 
+// Параллельный режим: сканер в главном потоке режет выгрузку на пачки
+// документов, пул потоков токенизирует пачки в собственные буферы, а главный
+// поток пишет буферы строго в порядке docid — вывод совпадает с однопоточным.
+
+struct Batch {
+    uint64_t first_docid = 0;
+    size_t end_off = 0;
+    std::vector<size_t> values;
+    std::vector<std::string> extras;  // extra_count строк на документ
+    size_t extra_count = 0;
+    size_t value_bytes = 0;
+    TokenOut out;
+    TermTable local_terms;
+    Stats st;
+    bool done = false;
+};
+
+template <class Scanner>
+static void process_json_parallel(JsonInput& in,
+                                  Scanner& sc,
+                                  int log_every,
+                                  Outputs& outs,
+                                  const TokenOut& proto,
+                                  int threads,
+                                  Checkpoint& ck,
+                                  Stats& st) {
+    auto t0 = std::chrono::high_resolution_clock::now();
+    const size_t max_inflight = (size_t)threads * 4;
+
+    std::mutex mu;
+    std::condition_variable cv_work, cv_done;
+    std::deque<Batch*> todo;
+    bool closing = false;
+
+    auto worker = [&]() {
+        std::string arena;
+        for (;;) {
+            Batch* b = nullptr;
+            {
+                std::unique_lock<std::mutex> lk(mu);
+                cv_work.wait(lk, [&] { return closing || !todo.empty(); });
+                if (todo.empty()) return;
+                b = todo.front();
+                todo.pop_front();
+            }
+            uint64_t docid = b->first_docid;
+            for (size_t j = 0; j < b->values.size(); j++, docid++) {
+                std::string_view val = json_string_view(in.data, in.size, b->values[j], arena);
+                b->st.docs_with_field++;
+                uint64_t tokens_before = b->st.tokens;
+                tokenize_text_utf8_emit(val, b->st, b->out, docid);
+                if (b->extra_count)
+                    tokenize_extras(&b->extras[j * b->extra_count], b->extra_count, b->st, b->out, docid);
+                count_doc(b->out, b->st, tokens_before, val.size());
+            }
+            end_block(b->out);
+            {
+                std::lock_guard<std::mutex> lk(mu);
+                b->done = true;
+            }
+            cv_done.notify_all();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve((size_t)threads);
+    for (int t = 0; t < threads; t++) pool.emplace_back(worker);
+
+    std::deque<std::unique_ptr<Batch>> inflight;
+    uint64_t next_log = (uint64_t)log_every;
+    int batches = 0;
+
+    auto retire = [&](bool wait) -> bool {
+        Batch* b = inflight.front().get();
+        {
+            std::unique_lock<std::mutex> lk(mu);
+            if (wait) cv_done.wait(lk, [&] { return b->done; });
+            else if (!b->done) return false;
+        }
+        write_out(outs.tokens, b->out.buf);
+        if (outs.vocab) {
+            remap_ids(b->out.ids, b->local_terms, *outs.vocab);
+            flush_ids(outs, b->out.ids);
+        }
+        if (outs.doc_counts)
+            outs.doc_counts->insert(outs.doc_counts->end(), b->out.doc_counts.begin(), b->out.doc_counts.end());
+        st.add(b->st);
+        if (ck.path && ++batches % ck.every == 0)
+            save_checkpoint(ck, outs, b->end_off, b->first_docid + b->values.size(), st);
+        if (log_every > 0 && st.docs_with_field >= next_log) {
+            log_progress(st, t0);
+            while (next_log <= st.docs_with_field) next_log += (uint64_t)log_every;
+        }
+        inflight.pop_front();
+        in.release_before(inflight.empty() ? sc.pos() : inflight.front()->values.front());
+        return true;
+    };
+
+    std::unique_ptr<Batch> cur;
+    auto submit = [&]() {
+        while (inflight.size() >= max_inflight) retire(true);
+        cur->end_off = sc.pos();
+        Batch* b = cur.get();
+        inflight.push_back(std::move(cur));
+        {
+            std::lock_guard<std::mutex> lk(mu);
+            todo.push_back(b);
+        }
+        cv_work.notify_one();
+        while (!inflight.empty() && retire(false)) {}
+    };
+
+    uint64_t docid = ck.next_docid;
+    size_t vbeg, vend;
+    while (sc.next(nullptr, vbeg, vend)) {
+        if (!cur) {
+            cur.reset(new Batch);
+            cur->first_docid = docid;
+            cur->out = proto;
+            if (proto.terms) cur->out.terms = &cur->local_terms;
+        }
+        cur->values.push_back(vbeg);
+        cur->extra_count = sc.extra_count();
+        cur->extras.insert(cur->extras.end(), sc.extras(), sc.extras() + sc.extra_count());
+        cur->value_bytes += vend - vbeg;
+        docid++;
+        if (cur->value_bytes >= kBatchBytes || cur->values.size() >= kBatchDocs) submit();
+    }
+    if (cur) submit();
+    while (!inflight.empty()) retire(true);
+    save_checkpoint(ck, outs, sc.pos(), docid, st);
+
+    {
+        std::lock_guard<std::mutex> lk(mu);
+        closing = true;
+    }
+    cv_work.notify_all();
+    for (auto& t : pool) t.join();
+}
+
+
+
+// Бенчмарк (--bench): синтетическая выгрузка в памяти с управляемым размером,
+// долей кириллицы, плотностью escape-последовательностей и балластом raw_html.
+// Сканер, токенизатор и весь конвейер меряются по отдельности; результат —
+// JSON с MB/s, tokens/s, тактами TSC на байт и (в сборке с -DLR3_BENCH)
+// числом выделений памяти.
+struct BenchConfig {
+    double mb = 64.0;
+    double cyr = 0.5;
+    double esc = 0.0;
+    size_t html = 2048;
+    int iters = 3;
+    uint64_t seed = 1;
+    const char* out = nullptr;
+};
+
+static inline uint64_t cycles_now() {
+#ifdef LR3_HAVE_X86_KERNELS
+    return (uint64_t)__rdtsc();
+#else
+    return 0;
+#endif
+}
+
+struct BenchRng {
+    uint64_t s;
+    uint64_t next() {
+        s ^= s << 13;
+        s ^= s >> 7;
+        s ^= s << 17;
+        return s;
+    }
+    size_t below(size_t n) { return (size_t)(next() % n); }
+    bool chance(double p) { return (double)(next() >> 11) * (1.0 / 9007199254740992.0) < p; }
+};
+
+// Значение JSON-строки: каждый символ с вероятностью esc пишется как \uXXXX.
+static void bench_json_string(std::string& out, const std::string& utf8, double esc, BenchRng& rng) {
+    static const char* hex = "0123456789abcdef";
+    out.push_back('"');
+    size_t i = 0;
+    while (i < utf8.size()) {
+        size_t start = i;
+        uint32_t cp = utf8_next(utf8.data(), utf8.size(), i);
+        if (cp == '"' || cp == '\\') { out.push_back('\\'); out.push_back((char)cp); continue; }
+        if (cp == '\n') { out.append("\\n"); continue; }
+        if (esc > 0.0 && cp < 0x10000u && rng.chance(esc)) {
+            char u[6] = {'\\', 'u', hex[(cp >> 12) & 15], hex[(cp >> 8) & 15], hex[(cp >> 4) & 15], hex[cp & 15]};
+            out.append(u, 6);
+            continue;
+        }
+        out.append(utf8, start, i - start);
+    }
+    out.push_back('"');
+}
+
+static std::string bench_corpus(const BenchConfig& c, uint64_t& docs) {
+    static const char* cyr[] = {"ка", "ло", "ми", "ст", "ра", "но", "ве", "ть", "про", "ой", "ск", "ие",
+                                "Мо", "Ст", "Ки", "ёл", "жи", "щу", "ый", "ЦЕ"};
+    static const char* lat[] = {"ta", "ko", "ri", "st", "en", "ma", "lo", "ne", "Th", "ing", "Qu", "ex"};
+    static const char* seps[] = {" ", " ", " ", ", ", ". ", " - ", "-", "\n", " (", ") ", " 2024 ", " №7 "};
+
+    BenchRng rng{c.seed * 0x9E3779B97F4A7C15ull + 1};
+    const size_t target = (size_t)(c.mb * 1024.0 * 1024.0);
+    std::string json("[\n");
+    std::string text, html;
+    docs = 0;
+    while (json.size() < target) {
+        text.clear();
+        size_t words = 50 + rng.below(1000);
+        for (size_t w = 0; w < words; w++) {
+            bool is_cyr = rng.chance(c.cyr);
+            size_t syl = 1 + rng.below(4);
+            for (size_t k = 0; k < syl; k++)
+                text += is_cyr ? cyr[rng.below(sizeof(cyr) / sizeof(cyr[0]))] : lat[rng.below(sizeof(lat) / sizeof(lat[0]))];
+            text += seps[rng.below(sizeof(seps) / sizeof(seps[0]))];
+        }
+        html.clear();
+        while (html.size() < c.html) html += "<div class=\"b\"><a href=\"/wiki/x\">ссылка</a></div>\n";
+
+        if (docs) json += ",\n";
+        json += "{\"_id\": {\"$oid\": \"000000000000000000000000\"}, \"source\": \"wiki\", \"url_norm\": \"https://ru.wikipedia.org/wiki/Doc_";
+        append_u64(json, docs);
+        json += "\", \"raw_html\": ";
+        bench_json_string(json, html, 0.0, rng);
+        json += ", \"parsed_text\": ";
+        bench_json_string(json, text, c.esc, rng);
+        json += ", \"content_hash\": \"1a2b8f1ff1fd42a29755d4c13a902931cd447e35\", \"updated_at\": 1700000000}";
+        docs++;
+    }
+    json += "\n]\n";
+    return json;
+}
+
+struct BenchResult {
+    double ms = 0.0;
+    uint64_t cycles = 0;
+    uint64_t allocs = 0;
+    uint64_t tokens = 0;
+};
+
+// Лучший из iters прогонов по времени.
+template <class F>
+static BenchResult bench_stage(int iters, F&& body) {
+    BenchResult best;
+    for (int it = 0; it < iters; it++) {
+        BenchResult r;
+#ifdef LR3_BENCH
+        uint64_t a0 = g_allocs.load(std::memory_order_relaxed);
+#endif
+        uint64_t c0 = cycles_now();
+        auto t0 = std::chrono::high_resolution_clock::now();
+        r.tokens = body();
+        auto t1 = std::chrono::high_resolution_clock::now();
+        r.cycles = cycles_now() - c0;
+#ifdef LR3_BENCH
+        r.allocs = g_allocs.load(std::memory_order_relaxed) - a0;
+#endif
+        r.ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+        if (it == 0 || r.ms < best.ms) best = r;
+    }
+    return best;
+}
+
+static void bench_json_stage(std::string& out, const char* name, const BenchResult& r, uint64_t bytes, bool last) {
+    double sec = r.ms / 1000.0;
+    char allocs[64] = "";
+#ifdef LR3_BENCH
+    std::snprintf(allocs, sizeof(allocs), ", \"allocs\": %llu", (unsigned long long)r.allocs);
+#endif
+    char line[512];
+    std::snprintf(line, sizeof(line),
+        "    \"%s\": {\"ms\": %.3f, \"bytes\": %llu, \"mb_s\": %.2f, \"tokens\": %llu, \"tokens_s\": %.0f, "
+        "\"cycles_per_byte\": %.3f%s}%s\n",
+        name, r.ms, (unsigned long long)bytes, sec > 0.0 ? (double)bytes / (1024.0 * 1024.0) / sec : 0.0,
+        (unsigned long long)r.tokens, sec > 0.0 ? (double)r.tokens / sec : 0.0,
+        bytes ? (double)r.cycles / (double)bytes : 0.0, allocs, last ? "" : ",");
+    out += line;
+}
+
+static int run_bench(const BenchConfig& c, const std::string& field, const TokenOut& proto, int threads) {
+    uint64_t docs = 0;
+    JsonInput in;
+    in.assign(bench_corpus(c, docs));
+
+    std::vector<std::string> values;
+    uint64_t text_bytes = 0;
+    {
+        FieldScanner sc(in, field, false);
+        std::string_view val;
+        size_t vbeg, vend;
+        while (sc.next(&val, vbeg, vend)) {
+            text_bytes += val.size();
+            values.emplace_back(val);
+        }
+    }
+
+    // Стадии scan и scan_decode токенов не выдают: tokens в отчёте для них 0.
+    BenchResult scan = bench_stage(c.iters, [&]() -> uint64_t {
+        FieldScanner sc(in, field, false);
+        size_t vbeg, vend;
+        while (sc.next(nullptr, vbeg, vend)) {}
+        return 0;
+    });
+
+    BenchResult decode = bench_stage(c.iters, [&]() -> uint64_t {
+        FieldScanner sc(in, field, false);
+        std::string_view val;
+        size_t vbeg, vend;
+        while (sc.next(&val, vbeg, vend)) {}
+        return 0;
+    });
+
+    BenchResult tok = bench_stage(c.iters, [&]() -> uint64_t {
+        Stats st;
+        TokenOut out = proto;
+        out.enabled = false;
+        for (size_t d = 0; d < values.size(); d++) tokenize_text_utf8_emit(values[d], st, out, d);
+        return st.tokens;
+    });
+
+    BenchResult e2e = bench_stage(c.iters, [&]() -> uint64_t {
+        Stats st;
+        Outputs outs;
+        Checkpoint ck;
+        FieldScanner sc(in, field, false);
+        if (threads > 1) process_json_parallel(in, sc, 0, outs, proto, threads, ck, st);
+        else process_json_in_memory(sc, 0, outs, proto, ck, st);
+        return st.tokens;
+    });
+
+    char head[512];
+    std::snprintf(head, sizeof(head),
+        "{\n  \"config\": {\"mb\": %.2f, \"cyr\": %.3f, \"esc\": %.3f, \"html\": %zu, \"iters\": %d, \"seed\": %llu, "
+        "\"threads\": %d, \"simd\": \"%s\", \"format\": \"%s\"},\n"
+        "  \"corpus\": {\"bytes\": %zu, \"docs\": %llu, \"text_bytes\": %llu},\n  \"stages\": {\n",
+        c.mb, c.cyr, c.esc, c.html, c.iters, (unsigned long long)c.seed, threads, g_kernels.name,
+        proto.format == TokenFormat::Bin ? "bin" : "text",
+        in.size, (unsigned long long)docs, (unsigned long long)text_bytes);
+    std::string report = head;
+    bench_json_stage(report, "scan", scan, in.size, false);
+    bench_json_stage(report, "scan_decode", decode, in.size, false);
+    bench_json_stage(report, "tokenize", tok, text_bytes, false);
+    bench_json_stage(report, "end_to_end", e2e, in.size, true);
+    report += "  }\n}\n";
+
+    if (c.out) {
+        FILE* f = std::fopen(c.out, "wb");
+        if (!f) die("Не удалось открыть файл отчёта бенчмарка");
+        std::fwrite(report.data(), 1, report.size(), f);
+        std::fclose(f);
+    } else {
+        std::fwrite(report.data(), 1, report.size(), stdout);
+    }
+    return 0;
+}
+
+// При возобновлении файл дописывается с размера из контрольной точки.
+static FILE* open_output(const char* path, bool resumed, uint64_t bytes) {
+    if (!resumed) return std::fopen(path, "wb");
+    FILE* f = std::fopen(path, "r+b");
+    if (!f) return nullptr;
+    if (::ftruncate(::fileno(f), (off_t)bytes) != 0) die("Не удалось обрезать выходной файл");
+    std::fseek(f, 0, SEEK_END);
+    return f;
+}
+
 static const char* arg_value(int& i, int argc, char** argv) {
     if (i + 1 >= argc) die("Отсутствует значение аргумента");
     return argv[++i];
@@ -318,16 +2152,75 @@ int main(int argc, char** argv) {
     int log_every = 0;
 
     const char* emit_path = nullptr;
+    const char* ids_path = nullptr;
+    const char* vocab_path = nullptr;
     bool with_docid = false;
+    int threads = 1;
+    std::string simd = "auto";
+    std::string format = "text";
+    bool fold = true;
+    bool fold_yo = false;
+    bool offsets = false;
+    bool ndjson = false;
+    const char* checkpoint_path = nullptr;
+    int checkpoint_every = 64;
+    bool resume = false;
+    const char* manifest_path = nullptr;
+    const char* tombstones_path = nullptr;
+    const char* docs_path = nullptr;
+    const char* index_path = nullptr;
+    std::vector<std::string> extra_fields;
+    bool bench = false;
+    BenchConfig bc;
 
     for (int i = 1; i < argc; ++i) {
         if (std::strcmp(argv[i], "--json") == 0) json_path = arg_value(i, argc, argv);
         else if (std::strcmp(argv[i], "--field") == 0) field = arg_value(i, argc, argv);
         else if (std::strcmp(argv[i], "--log_every") == 0) { log_every = std::atoi(arg_value(i, argc, argv)); if (log_every < 0) log_every = 0; }
         else if (std::strcmp(argv[i], "--emit_tokens") == 0) emit_path = arg_value(i, argc, argv);
+        else if (std::strcmp(argv[i], "--emit_ids") == 0) ids_path = arg_value(i, argc, argv);
+        else if (std::strcmp(argv[i], "--vocab") == 0) vocab_path = arg_value(i, argc, argv);
         else if (std::strcmp(argv[i], "--with_docid") == 0) with_docid = (std::atoi(arg_value(i, argc, argv)) != 0);
+        else if (std::strcmp(argv[i], "--threads") == 0) threads = std::atoi(arg_value(i, argc, argv));
+        else if (std::strcmp(argv[i], "--simd") == 0) simd = arg_value(i, argc, argv);
+        else if (std::strcmp(argv[i], "--format") == 0) format = arg_value(i, argc, argv);
+        else if (std::strcmp(argv[i], "--fold") == 0) fold = (std::atoi(arg_value(i, argc, argv)) != 0);
+        else if (std::strcmp(argv[i], "--yo") == 0) fold_yo = (std::atoi(arg_value(i, argc, argv)) != 0);
+        else if (std::strcmp(argv[i], "--offsets") == 0) offsets = (std::atoi(arg_value(i, argc, argv)) != 0);
+        else if (std::strcmp(argv[i], "--ndjson") == 0) ndjson = (std::atoi(arg_value(i, argc, argv)) != 0);
+        else if (std::strcmp(argv[i], "--checkpoint") == 0) checkpoint_path = arg_value(i, argc, argv);
+        else if (std::strcmp(argv[i], "--checkpoint_every") == 0) checkpoint_every = std::atoi(arg_value(i, argc, argv));
+        else if (std::strcmp(argv[i], "--resume") == 0) resume = (std::atoi(arg_value(i, argc, argv)) != 0);
+        else if (std::strcmp(argv[i], "--manifest") == 0) manifest_path = arg_value(i, argc, argv);
+        else if (std::strcmp(argv[i], "--tombstones") == 0) tombstones_path = arg_value(i, argc, argv);
+        else if (std::strcmp(argv[i], "--docs") == 0) docs_path = arg_value(i, argc, argv);
+        else if (std::strcmp(argv[i], "--index") == 0) index_path = arg_value(i, argc, argv);
+        else if (std::strcmp(argv[i], "--bench") == 0) bench = (std::atoi(arg_value(i, argc, argv)) != 0);
+        else if (std::strcmp(argv[i], "--bench_mb") == 0) bc.mb = std::atof(arg_value(i, argc, argv));
+        else if (std::strcmp(argv[i], "--bench_cyr") == 0) bc.cyr = std::atof(arg_value(i, argc, argv));
+        else if (std::strcmp(argv[i], "--bench_esc") == 0) bc.esc = std::atof(arg_value(i, argc, argv));
+        else if (std::strcmp(argv[i], "--bench_html") == 0) bc.html = (size_t)std::atol(arg_value(i, argc, argv));
+        else if (std::strcmp(argv[i], "--bench_iters") == 0) bc.iters = std::atoi(arg_value(i, argc, argv));
+        else if (std::strcmp(argv[i], "--bench_seed") == 0) bc.seed = (uint64_t)std::atoll(arg_value(i, argc, argv));
+        else if (std::strcmp(argv[i], "--bench_out") == 0) bc.out = arg_value(i, argc, argv);
+        else if (std::strcmp(argv[i], "--fields") == 0) {
+            std::string list = arg_value(i, argc, argv);
+            for (size_t a = 0, b; a <= list.size(); a = b + 1) {
+                b = list.find(',', a);
+                if (b == std::string::npos) b = list.size();
+                if (b > a) extra_fields.push_back(list.substr(a, b - a));
+            }
+        }
         else if (std::strcmp(argv[i], "--help") == 0 || std::strcmp(argv[i], "-h") == 0) {
-            std::printf("Usage:\n  %s --json <file.json> [--field name] [--log_every N] [--emit_tokens file] [--with_docid 0|1]\n", argv[0]);
+            std::printf("Usage:\n  %s --json <file.json> [--field name] [--log_every N] [--emit_tokens file] [--with_docid 0|1] [--threads N]\n"
+                        "  [--simd auto|avx2|sse42|scalar] [--format text|bin] [--offsets 0|1]\n"
+                        "  [--fold 0|1] [--yo 0|1] [--emit_ids ids.bin --vocab vocab.bin] [--ndjson 0|1]\n"
+                        "  [--checkpoint file] [--checkpoint_every N] [--resume 0|1]\n"
+                        "  [--manifest manifest.bin [--tombstones tombstones.bin]] [--docs docs.bin] [--index index.bin]\n"
+                        "  [--fields title,source,...]\n"
+                        "  %s --bench 1 [--bench_mb 64] [--bench_cyr 0.5] [--bench_esc 0] [--bench_html 2048]\n"
+                        "  [--bench_iters 3] [--bench_seed 1] [--bench_out report.json] [--threads N] [--simd ...] [--format ...]\n",
+                        argv[0], argv[0]);
             return 0;
         } else {
             std::fprintf(stderr, "Unknown arg: %s\n", argv[i]);
@@ -335,23 +2228,132 @@ int main(int argc, char** argv) {
         }
     }
 
-    if (!json_path) die("Не задан --json <file>");
+    if (!json_path && !bench) die("Не задан --json <file>");
+    if (format != "text" && format != "bin") die("--format: ожидается text или bin");
+    if (fold_yo && !fold) die("--yo 1 требует --fold 1");
+    if (fold_yo && format == "text")
+        std::fprintf(stderr, "NOTE: текстовый поток не хранит режим ё, передайте --yo 1 и в lr5_stem/lr6_index\n");
+    if (offsets && format != "bin") die("--offsets требует --format bin");
+    if (!ids_path != !vocab_path) die("--emit_ids и --vocab задаются вместе");
+    if (resume && !checkpoint_path) die("--resume 1 требует --checkpoint <file>");
+    if (checkpoint_every <= 0) die("--checkpoint_every: ожидается N > 0");
+    if (manifest_path && checkpoint_path) die("--manifest несовместим с --checkpoint");
+    if (tombstones_path && !manifest_path) die("--tombstones требует --manifest");
+    if (docs_path && checkpoint_path) die("--docs несовместим с --checkpoint");
+    if (!extra_fields.empty() && checkpoint_path) die("--fields несовместим с --checkpoint");
+    if (index_path && (checkpoint_path || manifest_path)) die("--index несовместим с --checkpoint и --manifest");
+    if (index_path && !fold) die("--index требует --fold 1");
+    if (!select_kernels(simd)) die("--simd: ядро не поддерживается этим процессором");
+    if (threads <= 0) threads = (int)std::max(1u, std::thread::hardware_concurrency());
+
+    if (bench) {
+        if (bc.mb <= 0.0 || bc.iters <= 0) die("--bench_mb и --bench_iters должны быть > 0");
+        TokenOut proto;
+        proto.enabled = true;
+        proto.format = (format == "bin") ? TokenFormat::Bin : TokenFormat::Text;
+        proto.fold = fold;
+        if (fold) init_fold_tables(fold_yo);
+        return run_bench(bc, field, proto, threads);
+    }
+
+    JsonInput json;
+    if (!json.open(json_path)) die("Не удалось прочитать JSON");
+
+    const uint32_t stream_flags = fold ? (kTsFoldCase | (fold_yo ? kTsFoldYo : 0u)) : 0u;
+    const uint32_t token_flags = stream_flags | (offsets ? kTsOffsets : 0u) |
+                                 (extra_fields.empty() ? 0u : kTsFields);
 
-    std::string json;
-    if (!read_file_all(json_path, json)) die("Не удалось прочитать JSON");
+    Checkpoint ck;
+    ck.path = checkpoint_path;
+    ck.every = checkpoint_every;
+    ck.vocab_path = vocab_path;
+    ck.flags = token_flags;
+    ck.format = format;
+    ck.field = field;
+    ck.input_size = json.size;
+    const bool resumed = resume && load_checkpoint(ck);
+    const uint64_t resume_docid = ck.next_docid;
 
     FILE* out = nullptr;
     if (emit_path) {
-        out = std::fopen(emit_path, "wb");
+        out = open_output(emit_path, resumed, ck.tokens_bytes);
         if (!out) die("Не удалось открыть файл для токенов");
     }
 
-    Stats st;
+    TokenOut proto;
+    proto.enabled = (out != nullptr);
+    proto.with_docid = with_docid;
+    proto.format = (format == "bin") ? TokenFormat::Bin : TokenFormat::Text;
+    proto.fold = fold;
+    proto.offsets = offsets;
+    proto.fields = !extra_fields.empty();
+    if (fold) init_fold_tables(fold_yo);
+    if (out && !resumed && proto.format == TokenFormat::Bin) write_stream_header(out, "IRTK", token_flags);
+
+    Outputs outs;
+    outs.tokens = out;
+    TermTable vocab;
+    if (ids_path) {
+        outs.ids = open_output(ids_path, resumed, ck.ids_bytes);
+        if (!outs.ids) die("Не удалось открыть файл для id термов");
+        if (resumed) load_vocab(vocab_path, vocab);
+        else write_stream_header(outs.ids, "IRTI", stream_flags);
+    }
+    IndexSink index;
+    if (index_path) {
+        index.start();
+        outs.index = &index;
+    }
+    if (ids_path || index_path) {
+        outs.vocab = &vocab;
+        proto.terms = &vocab;
+    }
+
+    FieldScanner fsc(json, field, threads <= 1);
+    fsc.lines = ndjson;
+    fsc.i = (size_t)ck.input_offset;
+
+    Manifest old_manifest;
+    std::vector<DocCount> doc_counts;
+    if (manifest_path) {
+        load_manifest(manifest_path, old_manifest);
+        ck.next_docid = old_manifest.next_docid;
+    }
+    if (manifest_path || docs_path) {
+        proto.count_docs = true;
+        outs.doc_counts = &doc_counts;
+    }
+    DocScanner dsc(fsc, manifest_path ? &old_manifest : nullptr, docs_path || index_path, threads <= 1);
+    dsc.extra_names = extra_fields;
+    dsc.extra_vals.resize(extra_fields.size());
+
+    Stats st = ck.st;
+    auto run = [&](auto& sc) {
+        if (threads > 1) process_json_parallel(json, sc, log_every, outs, proto, threads, ck, st);
+        else process_json_in_memory(sc, log_every, outs, proto, ck, st);
+    };
     auto t0 = std::chrono::high_resolution_clock::now();
-    process_json_in_memory(json, field, log_every, out, with_docid, st);
+    if (manifest_path || docs_path || index_path || !extra_fields.empty()) run(dsc);
+    else run(fsc);
+    if (index_path) {
+        index.finish();
+        write_index(index_path, index, vocab, dsc.fresh, kTsFoldCase | (fold_yo ? kTsFoldYo : 0u), t0);
+    }
     auto t1 = std::chrono::high_resolution_clock::now();
 
+    if (manifest_path) {
+        Manifest next;
+        dsc.finish(next, old_manifest.next_docid, doc_counts);
+        save_manifest(manifest_path, next);
+        if (tombstones_path) save_tombstones(tombstones_path, dsc.tombstones);
+    }
+    if (docs_path) save_docs_table(docs_path, old_manifest.next_docid, dsc.fresh, doc_counts);
+
     if (out) std::fclose(out);
+    if (outs.ids) {
+        std::fclose(outs.ids);
+        write_vocab(vocab_path, vocab, stream_flags);
+    }
 
     double ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
     double avglen = (st.tokens > 0) ? ((double)st.token_chars / (double)st.tokens) : 0.0;
@@ -366,13 +2368,46 @@ int main(int argc, char** argv) {
     std::printf("input_text_kb:\t\t%.3f\n", kb);
     std::printf("tokens:\t\t\t%llu\n", (unsigned long long)st.tokens);
     std::printf("avg_token_len:\t\t%.3f (без учёта диакритики)\n", avglen);
+    std::printf("threads:\t\t%d\n", threads);
+    if (ndjson) std::printf("input:\t\t\tndjson\n");
+    if (resumed) std::printf("resumed_from_doc:\t%llu\n", (unsigned long long)resume_docid);
+    if (manifest_path) {
+        std::printf("generation:\t\t%u\n", old_manifest.gen + 1);
+        std::printf("docs_new:\t\t%llu\n", (unsigned long long)dsc.added);
+        std::printf("docs_changed:\t\t%llu\n", (unsigned long long)dsc.changed);
+        std::printf("docs_unchanged:\t\t%llu\n", (unsigned long long)dsc.unchanged);
+        std::printf("docs_removed:\t\t%llu\n", (unsigned long long)dsc.removed);
+        if (dsc.skipped) std::printf("docs_skipped:\t\t%llu (нет url_norm или повтор)\n", (unsigned long long)dsc.skipped);
+        std::printf("tombstones:\t\t%llu\n", (unsigned long long)dsc.tombstones.size());
+    }
+    std::printf("simd:\t\t\t%s\n", g_kernels.name);
     std::printf("time_ms:\t\t%.3f\n", ms);
     std::printf("speed:\t\t\t%.3f KB/s\n", kbps);
     std::printf("time_per_kb:\t\t%.6f ms/KB\n", ms_per_kb);
 
+    if (docs_path) std::printf("docs_saved_to:\t\t%s\n", docs_path);
+    if (index_path) {
+        std::printf("index_terms:\t\t%llu\n", (unsigned long long)vocab.size());
+        std::printf("index_saved_to:\t\t%s\n", index_path);
+    }
+
+    if (ids_path) {
+        std::printf("vocab_terms:\t\t%llu\n", (unsigned long long)vocab.size());
+        std::printf("ids_saved_to:\t\t%s\n", ids_path);
+        std::printf("vocab_saved_to:\t\t%s\n", vocab_path);
+    }
+
     if (emit_path) {
         std::printf("tokens_saved_to:\t%s\n", emit_path);
-        std::printf("with_docid:\t\t%d\n", with_docid ? 1 : 0);
+        std::printf("format:\t\t\t%s\n", format.c_str());
+        std::printf("fold:\t\t\tcase=%d yo=%d\n", fold ? 1 : 0, fold_yo ? 1 : 0);
+        if (proto.format == TokenFormat::Text) std::printf("with_docid:\t\t%d\n", with_docid ? 1 : 0);
+        else std::printf("offsets:\t\t%d\n", offsets ? 1 : 0);
+        if (!extra_fields.empty()) {
+            std::printf("fields:\t\t\t0=%s", field.c_str());
+            for (size_t k = 0; k < extra_fields.size(); k++) std::printf(" %zu=%s", k + 1, extra_fields[k].c_str());
+            std::printf("\n");
+        }
     }
 
     return 0;
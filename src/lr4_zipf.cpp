@@ -1,93 +1,948 @@
 #include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <cctype>
 #include <cmath>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <string>
-#include <unordered_map>
+#include <thread>
 #include <vector>
 
-static inline std::string trim(const std::string& s) {
-    size_t a = 0, b = s.size();
-    while (a < b && (s[a] == '\r' || s[a] == '\n' || std::isspace((unsigned char)s[a]))) a++;
-    while (b > a && (s[b - 1] == '\r' || s[b - 1] == '\n' || std::isspace((unsigned char)s[b - 1]))) b--;
-    return s.substr(a, b - a);
-}
+#include "token_stream.h"
 
-static inline void to_lower_inplace(std::string& s) {
-    for (char &ch : s) {
+// Токен в нижнем регистре (только ASCII) в переиспользуемый буфер.
+static inline void assign_lower(std::string& buf, const char* p, size_t n) {
+    buf.assign(p, n);
+    for (char& ch : buf) {
         unsigned char c = (unsigned char)ch;
-        if (c < 128) ch = (char)std::tolower(c);
+        if (c >= 'A' && c <= 'Z') ch = (char)(c | 0x20u);
     }
 }
 
+using u8  = uint8_t;
+using u16 = uint16_t;
+using u32 = uint32_t;
+using u64 = uint64_t;
+
+static void die(const std::string& msg) {
+    std::cerr << "ERROR: " << msg << "\n";
+    std::exit(1);
+}
+
+static bool read_file(const std::string& path, std::string& out) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    in.seekg(0, std::ios::end);
+    std::streamoff sz = in.tellg();
+    if (sz < 0) return false;
+    in.seekg(0, std::ios::beg);
+    out.resize((size_t)sz);
+    return sz == 0 || (bool)in.read(&out[0], sz);
+}
+
+static inline u64 hash_bytes(const char* p, size_t n) {
+    u64 h = 1469598103934665603ull;
+    for (size_t i = 0; i < n; i++) {
+        h ^= (u8)p[i];
+        h *= 1099511628211ull;
+    }
+    return h ^ (h >> 29);
+}
+
+static const u64 kNoDoc = UINT64_MAX;
+
+// Таблица частот с открытой адресацией и линейным пробированием; ключи
+// лежат подряд в arena, в слотах — номер записи + 1 (0 — пусто). Кроме
+// частоты запись помнит первое вхождение терма в поток (для закона Хипса)
+// и число пар (терм, документ) — по ним прогнозируется размер POSTINGS.
+struct TermCounter {
+    struct Entry {
+        u64 hash;
+        u64 off;
+        u32 len;
+        u64 count;
+        u64 first;
+        u64 postings;
+        u64 first_doc;
+        u64 last_doc;
+    };
+    std::vector<u32> slots;
+    std::vector<Entry> entries;
+    std::string arena;
+    size_t mask = 0;
+
+    TermCounter() : slots(1u << 12, 0), mask((1u << 12) - 1) {}
+
+    void grow() {
+        slots.assign(slots.size() * 2, 0);
+        mask = slots.size() - 1;
+        for (size_t e = 0; e < entries.size(); e++) {
+            size_t i = entries[e].hash & mask;
+            while (slots[i]) i = (i + 1) & mask;
+            slots[i] = (u32)(e + 1);
+        }
+    }
+
+    // Запись терма; новая заводится с нулевыми счётчиками.
+    Entry& upsert(const char* p, size_t n, u64 h) {
+        size_t i = h & mask;
+        for (;;) {
+            u32 s = slots[i];
+            if (!s) break;
+            Entry& e = entries[s - 1];
+            if (e.hash == h && e.len == n && std::memcmp(arena.data() + e.off, p, n) == 0) return e;
+            i = (i + 1) & mask;
+        }
+        entries.push_back({h, (u64)arena.size(), (u32)n, 0, UINT64_MAX, 0, kNoDoc, kNoDoc});
+        arena.append(p, n);
+        slots[i] = (u32)entries.size();
+        if (entries.size() * 2 > slots.size()) grow();
+        return entries.back();
+    }
+
+    const char* key(const Entry& e) const { return arena.data() + e.off; }
+};
+
+// Локальный счётчик потока: токены приводятся к нижнему регистру через
+// assign_lower; tokens — номер токена внутри своего куска.
+struct LocalCounts {
+    TermCounter table;
+    std::string buf;
+    long long tokens = 0;
+
+    void add_token(const char* p, size_t n, u64 doc) {
+        assign_lower(buf, p, n);
+        TermCounter::Entry& e = table.upsert(buf.data(), buf.size(), hash_bytes(buf.data(), buf.size()));
+        if (!e.count) e.first = (u64)tokens;
+        e.count++;
+        if (doc != e.last_doc) {
+            if (e.first_doc == kNoDoc) e.first_doc = doc;
+            e.last_doc = doc;
+            e.postings++;
+        }
+        tokens++;
+    }
+};
+
+// Итог подсчёта: частоты, позиции первых вхождений термов в потоке (пусто,
+// если порядок неизвестен), число пар (терм, документ) и длины термов.
+struct TermStats {
+    std::vector<long long> f;
+    std::vector<u64> first;
+    u64 postings = 0;
+    bool has_docs = false;
+    u64 term_bytes = 0;
+};
+
+template <class F>
+static void parallel_for(int threads, F&& body) {
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++) pool.emplace_back(body, t);
+    body(0);
+    for (auto& th : pool) th.join();
+}
+
+// tokens.txt от lr3: по строке на токен, "[docid\t]token[\tfield]" —
+// --with_docid 1 добавляет docid впереди, --fields — id поля в конце.
+// Есть ли колонка docid, решается один раз по началу файла: строка из трёх
+// колонок или из двух, где числом является ровно одна, однозначно показывает,
+// где токен; одни лишь одноколоночные строки — поток без docid.
+static bool all_digits(const char* p, const char* e) {
+    while (e > p && std::isspace((unsigned char)e[-1])) e--;
+    if (p == e) return false;
+    for (; p < e; p++) if (*p < '0' || *p > '9') return false;
+    return true;
+}
+
+static bool detect_docid_column(const char* s, size_t n) {
+    const char* end = s + n;
+    for (int lines = 0; s < end && lines < 4096; lines++) {
+        const char* e = (const char*)std::memchr(s, '\n', (size_t)(end - s));
+        if (!e) e = end;
+        const char* t1 = (const char*)std::memchr(s, '\t', (size_t)(e - s));
+        if (t1) {
+            if (std::memchr(t1 + 1, '\t', (size_t)(e - t1 - 1))) return true;
+            bool d0 = all_digits(s, t1), d1 = all_digits(t1 + 1, e);
+            if (d0 != d1) return d0;
+        }
+        s = e + 1;
+    }
+    return false;
+}
+
+// Колонка токена в строке [p, e) без пробелов по краям; пусто — нет токена.
+static void token_column(const char*& p, const char*& e, bool docid_column) {
+    if (docid_column) {
+        const char* t = (const char*)std::memchr(p, '\t', (size_t)(e - p));
+        if (t) p = t + 1;
+    }
+    const char* t = (const char*)std::memchr(p, '\t', (size_t)(e - p));
+    if (t) e = t;
+    while (p < e && std::isspace((unsigned char)*p)) p++;
+    while (e > p && std::isspace((unsigned char)e[-1])) e--;
+}
+
+// Кусок потока начинается после '\n'.
+static void count_text_chunk(const std::string& data, size_t a, size_t b, bool docid_column, LocalCounts& lc) {
+    const char* s = data.data();
+    while (a < b) {
+        const void* q = std::memchr(s + a, '\n', b - a);
+        size_t e = q ? (size_t)((const char*)q - s) : b;
+        const char* x = s + a;
+        const char* y = s + e;
+        token_column(x, y, docid_column);
+        if (x < y) lc.add_token(x, (size_t)(y - x), kNoDoc);
+        a = e + 1;
+    }
+}
+
+struct BlockRef {
+    size_t off;
+    u32 tokens;
+    u32 bytes;
+};
+
+static std::vector<BlockRef> index_token_blocks(const std::string& data, u32& flags) {
+    if (data.size() < 16) die("token stream: bad header");
+    u32 head[3];
+    std::memcpy(head, data.data() + 4, sizeof(head));
+    if (head[0] != kTokStreamVersion) die("token stream: unsupported version (expected 1)");
+    flags = head[1];
+
+    std::vector<BlockRef> blocks;
+    size_t p = 16;
+    while (p + 12 <= data.size()) {
+        u32 blk[3];
+        std::memcpy(blk, data.data() + p, sizeof(blk));
+        if (blk[2] > data.size() - p - 12) die("token stream: truncated block");
+        blocks.push_back({p + 12, blk[0], blk[2]});
+        p += 12 + (size_t)blk[2];
+    }
+    return blocks;
+}
+
+static void count_token_blocks(const std::string& data, u32 flags, const BlockRef* b, const BlockRef* e,
+                               LocalCounts& lc) {
+    for (; b < e; b++) {
+        const u8* p = (const u8*)data.data() + b->off;
+        decode_token_block(p, p + b->bytes, b->tokens, flags, [&](u64 doc, u32, const char* tok, size_t len) {
+            lc.add_token(tok, len, doc);
+        });
+    }
+}
+
+// Слияние по разделам хеша: поток p забирает из всех локальных таблиц записи
+// своего раздела, так что каждый терм попадает ровно в одну итоговую таблицу.
+// Куски идут подряд, поэтому позиция первого вхождения сдвигается на число
+// токенов предыдущих кусков, а документ на стыке кусков не считается дважды.
+static void merge_counts(std::vector<LocalCounts>& locals, int threads, TermStats& ts) {
+    const size_t parts = (size_t)threads;
+    std::vector<std::vector<std::vector<u32>>> split(locals.size());
+    parallel_for((int)locals.size(), [&](int t) {
+        const TermCounter& tc = locals[t].table;
+        split[t].resize(parts);
+        for (size_t e = 0; e < tc.entries.size(); e++)
+            split[t][(tc.entries[e].hash >> 40) % parts].push_back((u32)e);
+    });
+    std::vector<u64> base(locals.size(), 0);
+    for (size_t t = 1; t < locals.size(); t++) base[t] = base[t - 1] + (u64)locals[t - 1].tokens;
+
+    std::vector<TermStats> part(parts);
+    parallel_for(threads, [&](int p) {
+        TermCounter merged;
+        for (size_t t = 0; t < locals.size(); t++) {
+            const TermCounter& tc = locals[t].table;
+            for (u32 e : split[t][p]) {
+                const TermCounter::Entry& en = tc.entries[e];
+                TermCounter::Entry& m = merged.upsert(tc.key(en), en.len, en.hash);
+                if (!m.count) m.first = base[t] + en.first;
+                m.count += en.count;
+                m.postings += en.postings;
+                if (en.first_doc != kNoDoc && en.first_doc == m.last_doc) m.postings--;
+                m.last_doc = en.last_doc;
+            }
+        }
+        TermStats& ps = part[p];
+        ps.f.reserve(merged.entries.size());
+        ps.first.reserve(merged.entries.size());
+        for (auto& en : merged.entries) {
+            ps.f.push_back((long long)en.count);
+            ps.first.push_back(en.first);
+            ps.postings += en.postings;
+            ps.term_bytes += en.len;
+        }
+    });
+    for (auto& ps : part) {
+        ts.f.insert(ts.f.end(), ps.f.begin(), ps.f.end());
+        ts.first.insert(ts.first.end(), ps.first.begin(), ps.first.end());
+        ts.postings += ps.postings;
+        ts.term_bytes += ps.term_bytes;
+    }
+}
+
+// Поток id (IRTI): словарь не нужен, частота терма — просто счётчик в плотном
+// массиве по term_id.
+static void count_term_ids(const std::string& data, int threads, TermStats& ts, long long& total) {
+    if (data.size() < 16) die("term id stream: bad header");
+    u32 version;
+    std::memcpy(&version, data.data() + 4, sizeof(version));
+    if (version != 1) die("term id stream: unsupported version (expected 1)");
+
+    struct IdCounts {
+        std::vector<u64> count, first, postings, first_doc, last_doc;
+    };
+    const size_t pairs = (data.size() - 16) / 8;
+    std::vector<IdCounts> local((size_t)threads);
+    parallel_for(threads, [&](int t) {
+        size_t a = pairs * (size_t)t / (size_t)threads, b = pairs * (size_t)(t + 1) / (size_t)threads;
+        IdCounts& c = local[t];
+        const char* p = data.data() + 16 + a * 8;
+        for (size_t k = a; k < b; k++, p += 8) {
+            u32 pr[2];
+            std::memcpy(pr, p, sizeof(pr));
+            u32 id = pr[1];
+            if (id >= c.count.size()) {
+                size_t n = std::max<size_t>((size_t)id + 1, c.count.size() * 2);
+                c.count.resize(n, 0);
+                c.first.resize(n, 0);
+                c.postings.resize(n, 0);
+                c.first_doc.resize(n, kNoDoc);
+                c.last_doc.resize(n, kNoDoc);
+            }
+            if (!c.count[id]) { c.first[id] = k; c.first_doc[id] = pr[0]; }
+            c.count[id]++;
+            if (c.last_doc[id] != pr[0]) { c.last_doc[id] = pr[0]; c.postings[id]++; }
+        }
+    });
+
+    IdCounts sum;
+    for (auto& c : local) {
+        if (c.count.size() > sum.count.size()) {
+            sum.count.resize(c.count.size(), 0);
+            sum.first.resize(c.count.size(), 0);
+            sum.last_doc.resize(c.count.size(), kNoDoc);
+        }
+        for (size_t id = 0; id < c.count.size(); id++) {
+            if (!c.count[id]) continue;
+            if (!sum.count[id]) sum.first[id] = c.first[id];
+            sum.count[id] += c.count[id];
+            ts.postings += c.postings[id];
+            if (c.first_doc[id] == sum.last_doc[id]) ts.postings--;
+            sum.last_doc[id] = c.last_doc[id];
+        }
+    }
+    for (size_t id = 0; id < sum.count.size(); id++) {
+        if (!sum.count[id]) continue;
+        ts.f.push_back((long long)sum.count[id]);
+        ts.first.push_back(sum.first[id]);
+        total += (long long)sum.count[id];
+    }
+    ts.has_docs = true;
+}
+
+// Частоты из индекса lr6_index (--index): DICT в IRIX v2 хранит cf каждого
+// терма, так что таблица рангов строится без потока токенов (порядка потока
+// в индексе нет, поэтому закон Хипса здесь не оценивается).
+static void read_index_cf(const std::string& path, TermStats& ts, long long& total) {
+    std::string data;
+    if (!read_file(path, data)) die("Cannot open index: " + path);
+    if (data.size() < 20 || std::memcmp(data.data(), "IRIX", 4) != 0) die("index: bad magic, expected IRIX");
+    u32 version, count;
+    u64 table_off;
+    std::memcpy(&version, data.data() + 4, 4);
+    std::memcpy(&count, data.data() + 8, 4);
+    std::memcpy(&table_off, data.data() + 12, 8);
+    if (version == 1) die("index: IRIX v1 has no cf, rebuild it with lr6_index");
+    if (version != 2) die("index: unsupported version (expected 2)");
+    if (table_off > data.size() || (u64)count * 24 > data.size() - table_off) die("index: bad section table");
+
+    u64 off = 0, size = 0;
+    bool found = false;
+    for (u32 k = 0; k < count && !found; k++) {
+        const char* e = data.data() + table_off + (u64)k * 24;
+        u32 type;
+        std::memcpy(&type, e, 4);
+        if (type != 1) continue;
+        std::memcpy(&off, e + 8, 8);
+        std::memcpy(&size, e + 16, 8);
+        found = true;
+    }
+    if (!found) die("index: DICT section(type=1) not found");
+    if (off > data.size() || size > data.size() - off || size < 4) die("index: DICT out of file");
+
+    const char* p = data.data() + off;
+    const char* end = p + size;
+    u32 terms;
+    std::memcpy(&terms, p, 4);
+    p += 4;
+    ts.f.reserve(terms);
+    for (u32 t = 0; t < terms; t++) {
+        if (end - p < 2) die("index: DICT truncated");
+        u16 len;
+        std::memcpy(&len, p, 2);
+        p += 2;
+        if ((size_t)(end - p) < (size_t)len + 20) die("index: DICT truncated");
+        p += len;
+        u32 df;
+        u64 cf;
+        std::memcpy(&df, p, 4);
+        std::memcpy(&cf, p + 4, 8);
+        p += 20;  // df, cf и postings_off
+        ts.f.push_back((long long)cf);
+        ts.postings += df;
+        ts.term_bytes += len;
+        total += (long long)cf;
+    }
+    ts.has_docs = true;
+}
+
+// Логарифмические контрольные точки N: по четыре на каждое удвоение плюс само N.
+static u64 next_checkpoint(u64 c) {
+    return std::max<u64>(c + 1, (u64)std::ceil((double)c * 1.189207115));
+}
+
+// Кривая роста словаря по первым вхождениям термов: V(N) — число термов,
+// впервые встретившихся среди первых N токенов.
+static std::vector<std::pair<u64, double>> growth_curve(std::vector<u64> first, u64 n) {
+    std::sort(first.begin(), first.end());
+    std::vector<std::pair<u64, double>> curve;
+    for (u64 c = 1; n; c = next_checkpoint(c)) {
+        if (c > n) c = n;
+        size_t v = (size_t)(std::lower_bound(first.begin(), first.end(), c) - first.begin());
+        curve.push_back({c, (double)v});
+        if (c == n) break;
+    }
+    return curve;
+}
+
+// Закон Хипса V = K * N^beta: МНК по log V от log N на точках с N >= 1000
+// (на малых N кривая ещё не вышла на степенной участок).
+static void fit_heaps(const std::vector<std::pair<u64, double>>& curve, double& K, double& beta) {
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    long long n = 0;
+    u64 from = curve.size() >= 3 && curve[curve.size() - 3].first >= 1000 ? 1000 : 1;
+    for (auto& pt : curve) {
+        if (pt.first < from || pt.second <= 0.0) continue;
+        double x = std::log((double)pt.first), y = std::log(pt.second);
+        sx += x; sy += y; sxx += x * x; sxy += x * y;
+        n++;
+    }
+    K = 0.0;
+    beta = 0.0;
+    if (n < 2) return;
+    double denom = n * sxx - sx * sx;
+    if (std::abs(denom) < 1e-12) return;
+    beta = (n * sxy - sx * sy) / denom;
+    K = std::exp((sy - beta * sx) / (double)n);
+}
+
+// Приближённый режим (--approx): поток читается один раз в фиксированной
+// памяти. Count-Min (depth x width счётчиков) завышает частоту не более чем на
+// e/width * N с вероятностью 1 - e^-depth; Space-Saving держит K самых частых
+// термов, его счётчик завышает не более чем на err <= N/K; HyperLogLog с 2^p
+// регистрами оценивает размер словаря с относительной ошибкой ~1.04/sqrt(2^p).
+static inline u64 mix64(u64 x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+struct CountMin {
+    size_t width, depth;
+    std::vector<u64> cells;
+
+    CountMin(size_t width_, size_t depth_) : width(width_), depth(depth_), cells(width_ * depth_, 0) {}
+
+    void add(u64 h) {
+        u64 h1 = (u32)h, h2 = (h >> 32) | 1u;
+        for (size_t r = 0; r < depth; r++) cells[r * width + ((h1 + r * h2) & (width - 1))]++;
+    }
+
+    u64 estimate(u64 h) const {
+        u64 h1 = (u32)h, h2 = (h >> 32) | 1u;
+        u64 v = UINT64_MAX;
+        for (size_t r = 0; r < depth; r++) v = std::min(v, cells[r * width + ((h1 + r * h2) & (width - 1))]);
+        return v;
+    }
+};
+
+struct HyperLogLog {
+    int p;
+    std::vector<u8> regs;
+
+    explicit HyperLogLog(int p_) : p(p_), regs((size_t)1 << p_, 0) {}
+
+    void add(u64 h) {
+        u64 x = mix64(h);
+        size_t idx = (size_t)(x >> (64 - p));
+        u64 w = x << p;
+        u8 rho = (u8)(w ? __builtin_clzll(w) + 1 : 64 - p + 1);
+        if (rho > regs[idx]) regs[idx] = rho;
+    }
+
+    double estimate() const {
+        const double m = (double)regs.size();
+        double sum = 0.0;
+        size_t zeros = 0;
+        for (u8 r : regs) {
+            sum += std::ldexp(1.0, -(int)r);
+            if (!r) zeros++;
+        }
+        double e = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+        if (e <= 2.5 * m && zeros) e = m * std::log(m / (double)zeros);
+        return e;
+    }
+
+    double rel_error() const { return 1.04 / std::sqrt((double)regs.size()); }
+};
+
+// Space-Saving: K счётчиков в min-куче по count; хеш-таблица ключей с
+// линейным пробированием и удалением сдвигом назад, так что память не растёт.
+struct SpaceSaving {
+    size_t k;
+    std::vector<std::string> keys;
+    std::vector<u64> hashes, counts, errs;
+    std::vector<u32> heap, at;  // at[e] — позиция записи e в куче
+    std::vector<u32> slots;
+    size_t mask;
+
+    explicit SpaceSaving(size_t k_) : k(k_) {
+        size_t cap = 16;
+        while (cap < k * 2) cap <<= 1;
+        slots.assign(cap, 0);
+        mask = cap - 1;
+        keys.reserve(k);
+    }
+
+    size_t find_slot(u32 e) const {
+        size_t i = hashes[e] & mask;
+        while (slots[i] != e + 1) i = (i + 1) & mask;
+        return i;
+    }
+
+    void erase_slot(size_t i) {
+        for (size_t j = i;;) {
+            j = (j + 1) & mask;
+            if (!slots[j]) break;
+            size_t home = hashes[slots[j] - 1] & mask;
+            bool movable = (j > i) ? (home <= i || home > j) : (home <= i && home > j);
+            if (movable) { slots[i] = slots[j]; i = j; }
+        }
+        slots[i] = 0;
+    }
+
+    void sift_down(size_t pos) {
+        const size_t n = heap.size();
+        for (;;) {
+            size_t l = pos * 2 + 1, m = pos;
+            if (l < n && counts[heap[l]] < counts[heap[m]]) m = l;
+            if (l + 1 < n && counts[heap[l + 1]] < counts[heap[m]]) m = l + 1;
+            if (m == pos) return;
+            std::swap(heap[pos], heap[m]);
+            at[heap[pos]] = (u32)pos;
+            at[heap[m]] = (u32)m;
+            pos = m;
+        }
+    }
+
+    void sift_up(size_t pos) {
+        while (pos > 0) {
+            size_t parent = (pos - 1) / 2;
+            if (counts[heap[parent]] <= counts[heap[pos]]) return;
+            std::swap(heap[pos], heap[parent]);
+            at[heap[pos]] = (u32)pos;
+            at[heap[parent]] = (u32)parent;
+            pos = parent;
+        }
+    }
+
+    void add(const char* p, size_t n, u64 h) {
+        size_t i = h & mask;
+        for (; slots[i]; i = (i + 1) & mask) {
+            u32 e = slots[i] - 1;
+            if (hashes[e] == h && keys[e].size() == n && std::memcmp(keys[e].data(), p, n) == 0) {
+                counts[e]++;
+                sift_down(at[e]);
+                return;
+            }
+        }
+        if (keys.size() < k) {
+            u32 e = (u32)keys.size();
+            keys.emplace_back(p, n);
+            hashes.push_back(h);
+            counts.push_back(1);
+            errs.push_back(0);
+            at.push_back((u32)heap.size());
+            heap.push_back(e);
+            slots[i] = e + 1;
+            sift_up(heap.size() - 1);
+            return;
+        }
+        // Вытесняется минимум: новый терм наследует его счётчик как ошибку.
+        u32 e = heap[0];
+        erase_slot(find_slot(e));
+        keys[e].assign(p, n);
+        hashes[e] = h;
+        errs[e] = counts[e];
+        counts[e]++;
+        i = h & mask;
+        while (slots[i]) i = (i + 1) & mask;
+        slots[i] = e + 1;
+        sift_down(0);
+    }
+};
+
+// Потоковое чтение любого входа по токену (tokens.txt, IRTK, IRTI) без
+// загрузки файла целиком; у IRTI ключом служат 4 байта term_id.
+template <class F>
+static void stream_tokens(const std::string& path, F&& on_token) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) die("Cannot open tokens file: " + path);
+    char magic[4] = {0, 0, 0, 0};
+    in.read(magic, 4);
+    bool irtk = in && std::memcmp(magic, "IRTK", 4) == 0;
+    bool irti = in && std::memcmp(magic, "IRTI", 4) == 0;
+    if (!irtk && !irti) {
+        in.clear();
+        in.seekg(0, std::ios::beg);
+        std::string head(1 << 20, '\0');
+        in.read(&head[0], (std::streamsize)head.size());
+        head.resize((size_t)in.gcount());
+        const bool docid_column = detect_docid_column(head.data(), head.size());
+        in.clear();
+        in.seekg(0, std::ios::beg);
+        std::string line;
+        while (std::getline(in, line)) {
+            const char* a = line.data();
+            const char* b = a + line.size();
+            token_column(a, b, docid_column);
+            if (a < b) on_token(a, (size_t)(b - a));
+        }
+        return;
+    }
+
+    u32 head[3];
+    if (!in.read((char*)head, sizeof(head))) die("token stream: bad header");
+    if (head[0] != kTokStreamVersion) die("token stream: unsupported version (expected 1)");
+    if (irti) {
+        std::vector<u32> pairs(1 << 16);
+        for (;;) {
+            in.read((char*)pairs.data(), (std::streamsize)(pairs.size() * sizeof(u32)));
+            size_t got = (size_t)in.gcount() / 8;
+            for (size_t k = 0; k < got; k++) on_token((const char*)&pairs[k * 2 + 1], sizeof(u32));
+            if (!in) return;
+        }
+    }
+
+    read_token_blocks(in, head[1], [&](u64, u32, const char* p, size_t len) { on_token(p, len); });
+}
+
+// Частоты — целые с тяжёлым хвостом: почти все меньше kDenseFreq и
+// раскладываются гистограммой (сортировка подсчётом), редкие большие
+// сортируются обычным sort. Результат совпадает с sort по убыванию.
+static void rank_frequencies(std::vector<long long>& f) {
+    const long long kDenseFreq = 1 << 16;
+    std::vector<u64> hist((size_t)kDenseFreq, 0);
+    std::vector<long long> big;
+    for (long long c : f) {
+        if (c >= 0 && c < kDenseFreq) hist[(size_t)c]++;
+        else big.push_back(c);
+    }
+    std::sort(big.begin(), big.end(), std::greater<long long>());
+    size_t k = 0;
+    for (long long c : big) {
+        if (c < 0) break;
+        f[k++] = c;
+    }
+    for (long long c = kDenseFreq - 1; c >= 0; c--)
+        for (u64 j = hist[(size_t)c]; j; j--) f[k++] = c;
+    for (long long c : big) if (c < 0) f[k++] = c;
+}
+
+// Диапазоны рангов режутся на блоки фиксированного размера, чтобы частичные
+// суммы не зависели от числа потоков; потоки берут блоки через один.
+static const long long kRankBlock = 1 << 16;
+
+struct FitSums {
+    double x = 0, y = 0, xx = 0, xy = 0;
+    long long n = 0;
+};
+
+// МНК log f от log r на [r1, r2]; log f считается раз на серию равных частот.
+static FitSums fit_sums(const std::vector<long long>& f, long long r1, long long r2, int threads) {
+    const long long blocks = r2 >= r1 ? (r2 - r1) / kRankBlock + 1 : 0;
+    std::vector<FitSums> part((size_t)blocks);
+    parallel_for(threads, [&](int t) {
+        for (long long b = t; b < blocks; b += threads) {
+            FitSums& ps = part[(size_t)b];
+            long long from = r1 + b * kRankBlock, to = std::min(r2, from + kRankBlock - 1);
+            long long prev = -1;
+            double y = 0.0;
+            for (long long r = from; r <= to; r++) {
+                long long fr = f[(size_t)r - 1];
+                if (fr <= 0) continue;
+                if (fr != prev) { prev = fr; y = std::log((double)fr); }
+                double x = std::log((double)r);
+                ps.x += x;
+                ps.y += y;
+                ps.xx += x * x;
+                ps.xy += x * y;
+                ps.n++;
+            }
+        }
+    });
+    FitSums s;
+    for (auto& ps : part) {
+        s.x += ps.x;
+        s.y += ps.y;
+        s.xx += ps.xx;
+        s.xy += ps.xy;
+        s.n += ps.n;
+    }
+    return s;
+}
+
+static void append_ll(std::string& out, long long v) {
+    char tmp[24];
+    int n = 0;
+    bool neg = v < 0;
+    unsigned long long u = neg ? 0ull - (unsigned long long)v : (unsigned long long)v;
+    do { tmp[n++] = (char)('0' + u % 10); u /= 10; } while (u);
+    if (neg) out.push_back('-');
+    while (n) out.push_back(tmp[--n]);
+}
+
+static void append_fixed6(std::string& out, double v) {
+    char tmp[64];
+    int n = std::snprintf(tmp, sizeof(tmp), "%.6f", v);
+    if (n > 0) out.append(tmp, (size_t)std::min(n, (int)sizeof(tmp) - 1));
+}
+
+// zipf.tsv по строке на ранг: блоки форматируются параллельно волнами по
+// threads блоков и пишутся по порядку одним fwrite на блок.
+static bool write_rank_table(const std::string& path, const std::vector<long long>& f,
+                             const std::vector<long long>* f_lo, double C, double s, int threads) {
+    FILE* out = std::fopen(path.c_str(), "wb");
+    if (!out) return false;
+    std::string head = f_lo ? "# rank\tfreq\tzipf_fit\tfreq_lo\n" : "# rank\tfreq\tzipf_fit\n";
+    std::fwrite(head.data(), 1, head.size(), out);
+
+    const long long R = (long long)f.size();
+    const long long blocks = (R + kRankBlock - 1) / kRankBlock;
+    std::vector<std::string> buf((size_t)threads);
+    for (long long wave = 0; wave < blocks; wave += threads) {
+        parallel_for(threads, [&](int t) {
+            std::string& b = buf[(size_t)t];
+            b.clear();
+            long long blk = wave + t;
+            if (blk >= blocks) return;
+            long long from = blk * kRankBlock + 1, to = std::min(R, from + kRankBlock - 1);
+            for (long long r = from; r <= to; r++) {
+                append_ll(b, r);
+                b.push_back('\t');
+                append_ll(b, f[(size_t)r - 1]);
+                b.push_back('\t');
+                append_fixed6(b, C / std::pow((double)r, s));
+                if (f_lo) {
+                    b.push_back('\t');
+                    append_ll(b, (*f_lo)[(size_t)r - 1]);
+                }
+                b.push_back('\n');
+            }
+        });
+        for (auto& b : buf) std::fwrite(b.data(), 1, b.size(), out);
+    }
+    return std::fclose(out) == 0;
+}
+
+// --logbin B: B логарифмических корзин рангов на декаду; в строке — границы
+// корзины, среднегеометрический ранг, средняя частота, подгонка в этом ранге
+// и число термов. Файл остаётся маленьким и сразу годится для графика.
+static bool write_logbin_table(const std::string& path, const std::vector<long long>& f,
+                               double C, double s, int per_decade) {
+    FILE* out = std::fopen(path.c_str(), "wb");
+    if (!out) return false;
+    std::fputs("# rank_lo\trank_hi\trank_geo\tfreq_mean\tzipf_fit\tterms\n", out);
+    const long long R = (long long)f.size();
+    long long lo = 1;
+    for (int k = 1; lo <= R; k++) {
+        long long hi = std::min(R, (long long)std::floor(std::pow(10.0, (double)k / per_decade)));
+        if (hi < lo) continue;
+        double sum = 0.0;
+        for (long long r = lo; r <= hi; r++) sum += (double)f[(size_t)r - 1];
+        double geo = std::sqrt((double)lo * (double)hi);
+        std::fprintf(out, "%lld\t%lld\t%.3f\t%.6f\t%.6f\t%lld\n", lo, hi, geo, sum / (double)(hi - lo + 1),
+                     C / std::pow(geo, s), hi - lo + 1);
+        lo = hi + 1;
+    }
+    return std::fclose(out) == 0;
+}
+
 static double median(std::vector<double> v) {
     if (v.empty()) return 0.0;
-    std::sort(v.begin(), v.end());
     size_t n = v.size();
-    if (n % 2) return v[n/2];
-    return 0.5 * (v[n/2 - 1] + v[n/2]);
+    std::nth_element(v.begin(), v.begin() + n/2, v.end());
+    double hi = v[n/2];
+    if (n % 2) return hi;
+    return 0.5 * (*std::max_element(v.begin(), v.begin() + n/2) + hi);
 }
 
 int main(int argc, char** argv) {
     std::string in_path = "tokens.txt";
     std::string out_tsv = "zipf.tsv";
     std::string out_sum = "zipf_summary.txt";
+    int threads = 0;
+    std::string index_path;
+    bool approx = false;
+    size_t approx_k = 10000, cm_width = (size_t)1 << 19, cm_depth = 4;
+    int hll_p = 14;
+    std::string out_heaps = "heaps.tsv";
+    double target_tokens = 0.0;
+    int logbin = 0;
 
+    std::vector<std::string> pos;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--index") == 0 && i + 1 < argc) index_path = argv[++i];
+        else if (std::strcmp(argv[i], "--approx") == 0) approx = true;
+        else if (std::strcmp(argv[i], "--approx_k") == 0 && i + 1 < argc) approx_k = (size_t)std::atol(argv[++i]);
+        else if (std::strcmp(argv[i], "--cm_width") == 0 && i + 1 < argc) cm_width = (size_t)std::atol(argv[++i]);
+        else if (std::strcmp(argv[i], "--cm_depth") == 0 && i + 1 < argc) cm_depth = (size_t)std::atol(argv[++i]);
+        else if (std::strcmp(argv[i], "--hll_p") == 0 && i + 1 < argc) hll_p = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--heaps") == 0 && i + 1 < argc) out_heaps = argv[++i];
+        else if (std::strcmp(argv[i], "--target_tokens") == 0 && i + 1 < argc) target_tokens = std::atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--logbin") == 0 && i + 1 < argc) logbin = std::atoi(argv[++i]);
+        else pos.push_back(argv[i]);
+    }
+    if (!index_path.empty()) {
+        // Без потока токенов единственный позиционный аргумент — выходной tsv.
+        in_path = index_path;
+        if (pos.size() >= 1) out_tsv = pos[0];
+    } else {
+        if (pos.size() >= 1) in_path = pos[0];
+        if (pos.size() >= 2) out_tsv = pos[1];
+    }
+    if (threads <= 0) threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    if (approx) {
+        if (!index_path.empty()) die("--approx is for token streams, not --index");
+        if (approx_k < 1 || cm_depth < 1 || cm_width < 2 || (cm_width & (cm_width - 1))) die("--approx_k >= 1, --cm_depth >= 1, --cm_width: power of two");
+        if (hll_p < 4 || hll_p > 18) die("--hll_p must be in 4..18");
+    }
 
-    if (argc >= 2) in_path = argv[1];
-    if (argc >= 3) out_tsv  = argv[2];
-
-    std::ifstream in(in_path);
-    if (!in) {
+    std::string data;
+    if (index_path.empty() && !approx && !read_file(in_path, data)) {
         std::cerr << "Не могу открыть " << in_path << "\n";
         return 1;
     }
 
-    std::unordered_map<std::string, long long> freq;
-    freq.reserve(1 << 20);
-
+    TermStats ts;
+    std::vector<long long>& f = ts.f;
+    std::vector<std::pair<u64, double>> curve;  // (N, V) в контрольных точках
+    std::vector<long long> f_lo;  // --approx: гарантированные нижние границы частот
     long long total_tokens = 0;
-    std::string line;
-    while (std::getline(in, line)) {
-        std::string tok = trim(line);
-        if (tok.empty()) continue;
-        to_lower_inplace(tok);
-        freq[tok]++;
-        total_tokens++;
+    double V_est = 0.0, hll_err = 0.0;
+    long long ss_min = 0, reliable = 0;
+    if (approx) {
+        CountMin cm(cm_width, cm_depth);
+        HyperLogLog hll(hll_p);
+        SpaceSaving ss(approx_k);
+        std::string buf;
+        u64 next_cp = 1;
+        stream_tokens(in_path, [&](const char* p, size_t n) {
+            assign_lower(buf, p, n);
+            u64 h = mix64(hash_bytes(buf.data(), buf.size()));
+            cm.add(h);
+            hll.add(h);
+            ss.add(buf.data(), buf.size(), h);
+            total_tokens++;
+            if ((u64)total_tokens == next_cp) {
+                curve.push_back({next_cp, hll.estimate()});
+                next_cp = next_checkpoint(next_cp);
+            }
+        });
+        if (total_tokens && curve.back().first != (u64)total_tokens) curve.push_back({(u64)total_tokens, hll.estimate()});
+        for (auto& key : ss.keys) ts.term_bytes += key.size();
+        // Оба счётчика только завышают, поэтому берётся меньший из них.
+        std::vector<std::pair<long long, long long>> head;
+        for (size_t e = 0; e < ss.keys.size(); e++) {
+            long long hi = (long long)std::min(ss.counts[e], cm.estimate(ss.hashes[e]));
+            head.push_back({hi, (long long)(ss.counts[e] - ss.errs[e])});
+        }
+        std::sort(head.begin(), head.end(), std::greater<std::pair<long long, long long>>());
+        for (auto& hl : head) {
+            f.push_back(hl.first);
+            f_lo.push_back(hl.second);
+        }
+        // Терм с нижней границей выше минимального счётчика гарантированно
+        // входит в истинный top-K, поэтому подгонка идёт только по таким рангам.
+        if (ss.keys.size() == approx_k) ss_min = (long long)ss.counts[ss.heap[0]];
+        for (long long lo : f_lo) if (lo > ss_min) reliable++;
+        V_est = hll.estimate();
+        hll_err = hll.rel_error();
+    } else if (!index_path.empty()) {
+        read_index_cf(index_path, ts, total_tokens);
+    } else if (data.size() >= 4 && std::memcmp(data.data(), "IRTI", 4) == 0) {
+        count_term_ids(data, threads, ts, total_tokens);
+    } else {
+        std::vector<LocalCounts> locals((size_t)threads);
+        if (data.size() >= 4 && std::memcmp(data.data(), "IRTK", 4) == 0) {
+            u32 flags = 0;
+            std::vector<BlockRef> blocks = index_token_blocks(data, flags);
+            ts.has_docs = true;
+            parallel_for(threads, [&](int t) {
+                size_t a = blocks.size() * (size_t)t / (size_t)threads;
+                size_t b = blocks.size() * (size_t)(t + 1) / (size_t)threads;
+                count_token_blocks(data, flags, blocks.data() + a, blocks.data() + b, locals[t]);
+            });
+        } else {
+            // Границы кусков сдвигаются к началу следующей строки.
+            std::vector<size_t> cut((size_t)threads + 1, data.size());
+            cut[0] = 0;
+            for (int t = 1; t < threads; t++) {
+                size_t c = data.size() * (size_t)t / (size_t)threads;
+                const void* q = std::memchr(data.data() + c, '\n', data.size() - c);
+                cut[t] = std::max(cut[t - 1], q ? (size_t)((const char*)q - data.data()) + 1 : data.size());
+            }
+            const bool docid_column = detect_docid_column(data.data(), std::min(data.size(), (size_t)1 << 20));
+            parallel_for(threads, [&](int t) {
+                count_text_chunk(data, cut[t], cut[t + 1], docid_column, locals[t]);
+            });
+        }
+        for (auto& lc : locals) total_tokens += lc.tokens;
+        merge_counts(locals, threads, ts);
     }
-    in.close();
+    std::string().swap(data);
+    if (!ts.first.empty()) curve = growth_curve(std::move(ts.first), (u64)total_tokens);
 
-    if (freq.empty()) {
+    if (f.empty()) {
         std::cerr << "Пустой словарь: нет токенов.\n";
         return 2;
     }
 
-    std::vector<long long> f;
-    f.reserve(freq.size());
-    for (auto &kv : freq) f.push_back(kv.second);
-    std::sort(f.begin(), f.end(), std::greater<long long>());
+    if (!approx) rank_frequencies(f);
 
-    const long long V = (long long)f.size(); 
+    // В --approx известна только голова распределения (R = K рангов),
+    // а V — оценка HyperLogLog; диапазон подгонки обрезается по R.
+    const long long R = (long long)f.size();
+    const long long V = approx ? std::max<long long>(R, std::llround(V_est)) : R;
+    const long long R_fit = (approx && reliable >= 20) ? reliable : R;
 
     long long r1 = std::max<long long>(10, V / 100);
     long long r2 = std::max<long long>(r1 + 10, V / 2);
-
-    double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
-    long long n = 0;
-    for (long long r = r1; r <= r2; r++) {
-        long long fr = f[(size_t)r - 1];
-        if (fr <= 0) continue;
-        double x = std::log((double)r);
-        double y = std::log((double)fr);
-        sum_x  += x;
-        sum_y  += y;
-        sum_xx += x * x;
-        sum_xy += x * y;
-        n++;
+    if (r2 > R_fit) {
+        r2 = R_fit;
+        r1 = std::min(r1, std::max<long long>(1, r2 / 10));
     }
 
+    FitSums fs = fit_sums(f, r1, r2, threads);
+    const double sum_x = fs.x, sum_y = fs.y, sum_xx = fs.xx, sum_xy = fs.xy;
+    const long long n = fs.n;
+
     double slope = 0.0;
     if (n >= 2) {
         double denom = (n * sum_xx - sum_x * sum_x);
@@ -100,30 +955,44 @@ int main(int argc, char** argv) {
 
     if (!(s > 0.1 && s < 3.0)) s = 1.0;
 
-    std::vector<double> cands;
-    cands.reserve((size_t)std::max<long long>(0, r2 - r1 + 1));
-    for (long long r = r1; r <= r2; r++) {
-        long long fr = f[(size_t)r - 1];
-        if (fr <= 0) continue;
-        cands.push_back((double)fr * std::pow((double)r, s));
-    }
-    double C = cands.empty() ? (double)f[0] : median(cands);
+    // Кандидаты C = f(r) * r^s считаются параллельно по кускам рангов,
+    // нулевые частоты выбрасываются уже после.
+    std::vector<double> cands((size_t)std::max<long long>(0, r2 - r1 + 1));
+    parallel_for(threads, [&](int t) {
+        long long len = r2 - r1 + 1;
+        long long from = r1 + len * t / threads, to = r1 + len * (t + 1) / threads;
+        for (long long r = from; r < to; r++) {
+            long long fr = f[(size_t)r - 1];
+            cands[(size_t)(r - r1)] = fr > 0 ? (double)fr * std::pow((double)r, s) : -1.0;
+        }
+    });
+    cands.erase(std::remove(cands.begin(), cands.end(), -1.0), cands.end());
+    double C = cands.empty() ? (double)f[0] : median(std::move(cands));
 
-    std::ofstream out(out_tsv);
-    if (!out) {
+    bool written = logbin > 0 ? write_logbin_table(out_tsv, f, C, s, logbin)
+                              : write_rank_table(out_tsv, f, approx ? &f_lo : nullptr, C, s, threads);
+    if (!written) {
         std::cerr << "Не могу создать " << out_tsv << "\n";
         return 3;
     }
 
-    out << "# rank\tfreq\tzipf_fit\n";
-    out << std::fixed << std::setprecision(6);
 
-    for (long long r = 1; r <= V; r++) {
-        double fit = C / std::pow((double)r, s);
-        out << r << "\t" << f[(size_t)r - 1] << "\t" << fit << "\n";
+    // Закон Хипса и прогноз IRIX для целевого N: DICT — 22 байта на терм
+    // (u16 len, u32 df, u64 cf, u64 postings_off) плюс сам терм, POSTINGS — по
+    // 4 байта на пару (терм, документ); доля пар на токен берётся из входа.
+    double K = 0.0, beta = 0.0;
+    const double Nt = target_tokens > 0.0 ? target_tokens : 10.0 * (double)total_tokens;
+    const double known = approx ? (double)f.size() : (double)V;
+    const double avg_len = known > 0 ? (double)ts.term_bytes / known : 0.0;
+    const double ppt = ts.has_docs && total_tokens ? (double)ts.postings / (double)total_tokens : 1.0;
+    if (!curve.empty()) {
+        fit_heaps(curve, K, beta);
+        std::ofstream ho(out_heaps);
+        if (ho) {
+            ho << "# N\tV\theaps_fit\n" << std::fixed << std::setprecision(1);
+            for (auto& pt : curve) ho << pt.first << "\t" << pt.second << "\t" << K * std::pow((double)pt.first, beta) << "\n";
+        }
     }
-    out.close();
-
 
     std::ofstream sum(out_sum);
     if (sum) {
@@ -135,6 +1004,29 @@ int main(int argc, char** argv) {
         sum << "s = " << std::setprecision(6) << s << "\n";
         sum << "C = " << std::setprecision(6) << C << "\n";
         sum << "Диапазон оценки (r1..r2): " << r1 << ".." << r2 << "\n";
+        if (approx) {
+            const double eps = std::exp(1.0) / (double)cm_width;
+            sum << "Режим: --approx (в zipf.tsv первые " << R << " рангов, freq — верхняя, freq_lo — нижняя граница)\n";
+            sum << "V: оценка HyperLogLog, p = " << hll_p << ", отн. ошибка ~" << std::setprecision(4)
+                << hll_err * 100.0 << "% (1 sigma)\n";
+            sum << "Count-Min " << cm_depth << "x" << cm_width << ": завышение <= " << std::setprecision(6)
+                << eps * (double)total_tokens << " с вероятностью " << (1.0 - std::exp(-(double)cm_depth)) << "\n";
+            sum << "Space-Saving K = " << approx_k << ": завышение <= N/K = "
+                << (double)total_tokens / (double)approx_k << ", минимальный счётчик " << ss_min
+                << ", надёжных рангов " << reliable << "\n";
+            sum << "Память: " << (cm_width * cm_depth * 8 + ((size_t)1 << hll_p) + approx_k * 64) / 1024 << " KiB\n";
+        }
+        if (!curve.empty()) {
+            const double Vt = K * std::pow(Nt, beta);
+            sum << std::setprecision(6);
+            sum << "Закон Хипса: V ~= K * N^beta, K = " << K << ", beta = " << beta
+                << " (" << curve.size() << " точек, кривая в " << out_heaps << ")\n";
+            sum << "Прогноз для N = " << Nt << ": V ~= " << std::llround(Vt) << "\n";
+            sum << "  DICT ~= " << (4.0 + Vt * (22.0 + avg_len)) / (1024.0 * 1024.0) << " MiB (22 + "
+                << avg_len << " байт на терм" << (ts.term_bytes ? "" : ", длины термов в потоке id неизвестны") << ")\n";
+            sum << "  POSTINGS ~= " << 4.0 * ppt * Nt / (1024.0 * 1024.0) << " MiB (4 байта на пару, " << ppt
+                << " пар на токен" << (ts.has_docs ? "" : ", верхняя граница: docid во входе нет") << ")\n";
+        }
     }
 
     std::cout << "OK: wrote " << out_tsv << "\n";
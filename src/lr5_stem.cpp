@@ -6,6 +6,7 @@
 #include <fstream>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <unordered_map>
@@ -13,6 +14,16 @@
 #include <utility>
 #include <vector>
 #include <cstring>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fold.h"
+#include "radix_sort.h"
+#include "token_stream.h"
 
 using std::string;
 
@@ -34,12 +45,6 @@ static inline string rtrim(string s) {
 }
 static inline string trim(string s) { return rtrim(ltrim(std::move(s))); }
 
-static inline string to_lower_ascii(string s) {
-    for (char &c : s) c = (char)std::tolower((unsigned char)c);
-    return s;
-}
-
-
 static string normalize_token_bytes(const string& in) {
     string s;
     s.reserve(in.size());
@@ -52,7 +57,7 @@ static string normalize_token_bytes(const string& in) {
         }
     }
 
-    s = to_lower_ascii(s);
+    s = fold_term(s);
     return s;
 }
 
@@ -138,82 +143,617 @@ static string stem_term(string term, bool enable_stem) {
 }
 
 
+using u8  = uint8_t;
+using u32 = uint32_t;
+using u64 = uint64_t;
+
+static void die(const string& msg) {
+    std::cerr << "ERROR: " << msg << "\n";
+    std::exit(1);
+}
+
+
 using DocId = int;
-using TFMap = std::unordered_map<DocId, int>;
-using Index = std::unordered_map<string, TFMap>;
+
+// Exhaustive — TAAT по всем постингам; Wand/BlockMaxWand — DAAT с отсечением
+// по верхним оценкам, top-k тот же.
+enum class Retrieval { Exhaustive, Wand, BlockMaxWand };
+
+// TfIdf — tf_weight * idf_weight; Bm25 — с длиной документа; Impact — BM25,
+// заранее квантованный в u8 на постинг.
+enum class Scoring { TfIdf, Bm25, Impact };
 
 struct SearchConfig {
     string tokens_path = "tokens.txt";
     int topk = 10;
     bool enable_stem = true;
     double exact_bonus = 0.5; 
+    int fold_yo = -1;     // --yo: свёртка ё в потоке; -1 — взять из заголовка / ranked.bin
+    u32 field_boost = 2;  // tf-вес токена доп. полей (--fields в lr3: title и т.п.)
+    Retrieval retrieval = Retrieval::BlockMaxWand;
+    Scoring scoring = Scoring::TfIdf;
+    double k1 = 1.2;
+    double b = 0.75;
+};
+
+static const u64 kBlock = 64;  // постингов в блоке Block-Max WAND
+
+// Сжатый ранжированный индекс (CSR): термы отсортированы, постинги терма t —
+// непрерывные срезы docs/tfs в [offs[t], offs[t+1]) по возрастанию docid.
+// Вместо узла хеш-таблицы на каждую пару (терм, документ) — 8 байт на пару.
+// Массивы — указатели либо в own_* (индекс собран из токенов), либо прямо
+// в отображённый файл ранжированного индекса (--index).
+struct CsrIndex {
+    const u64* term_offs = nullptr;  // границы термов в term_bytes, T+1 элементов
+    const char* term_bytes = nullptr;
+    const u64* offs = nullptr;       // T+1 элементов
+    const DocId* docs = nullptr;
+    const u32* tfs = nullptr;
+    const u32* block_max_tf = nullptr;  // max tf по блокам из kBlock постингов docs
+    size_t terms = 0;
+
+    std::vector<u64> own_term_offs, own_offs;
+    std::vector<char> own_term_bytes;
+    std::vector<DocId> own_docs;
+    std::vector<u32> own_tfs, own_block_max_tf;
+
+    void bind_owned() {
+        term_offs = own_term_offs.data();
+        term_bytes = own_term_bytes.data();
+        offs = own_offs.data();
+        docs = own_docs.data();
+        tfs = own_tfs.data();
+        terms = own_offs.empty() ? 0 : own_offs.size() - 1;
+        if (own_block_max_tf.empty()) build_block_max(tfs, postings());
+        block_max_tf = own_block_max_tf.data();
+    }
+
+    void build_block_max(const u32* tf, size_t n) {
+        own_block_max_tf.assign((n + kBlock - 1) / kBlock, 0);
+        for (size_t j = 0; j < n; j++) {
+            u32& m = own_block_max_tf[j / kBlock];
+            m = std::max(m, tf[j]);
+        }
+    }
+
+    size_t size() const { return terms; }
+    size_t postings() const { return terms ? (size_t)offs[terms] : 0; }
+
+    int find(const string& term) const {
+        size_t lo = 0, hi = terms;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            size_t len = (size_t)(term_offs[mid + 1] - term_offs[mid]);
+            int c = std::memcmp(term_bytes + term_offs[mid], term.data(), std::min(len, term.size()));
+            if (c == 0) c = len < term.size() ? -1 : (len > term.size() ? 1 : 0);
+            if (c == 0) return (int)mid;
+            if (c < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        return -1;
+    }
+
+    size_t bytes() const {
+        return (terms + 1) * 2 * sizeof(u64) + (terms ? (size_t)term_offs[terms] : 0) +
+               postings() * (sizeof(DocId) + sizeof(u32));
+    }
+};
+
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat sb;
+        bool ok = ::fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0;
+        if (ok) {
+            void* p = ::mmap(nullptr, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = p != MAP_FAILED;
+            if (ok) {
+                data = (const char*)p;
+                size = (size_t)sb.st_size;
+            }
+        }
+        ::close(fd);
+        return ok;
+    }
+
+    ~MappedFile() {
+        if (data) ::munmap((void*)data, size);
+    }
+};
+
+struct RankModel {
+    Scoring scoring = Scoring::TfIdf;
+    double k1 = 1.2, b = 0.75;
+    double avg_doc_len = 1.0;
+    double impact_scale = 1.0;
+    const u8* impacts = nullptr;  // по постингам stem_index, только для Impact
+    const double* block_unit = nullptr;
+    bool ready = false;  // посчитана или загружена из IRRX
+
+    std::vector<u8> own_impacts;
+    std::vector<double> own_block_unit;
 };
 
 struct CorpusIndex {
-    Index stem_index;
-    Index exact_index;
-    std::unordered_set<DocId> all_docs;
+    CsrIndex stem_index;
+    CsrIndex exact_index;
+    int num_docs = 0;
+    bool stemmed = true;  // как строились термы stem_index
+    size_t doc_span = 0;  // max docid + 1: размер плотных аккумуляторов
+    const u32* doc_len = nullptr;  // токенов в документе, по docid
+    std::vector<u32> own_doc_len;
+    RankModel model;
+    std::unique_ptr<MappedFile> file;
+};
+
+// Сборка CSR: токены копятся как пары (id терма << 32 | docid), id выдаются
+// в порядке появления; при заморозке id переводятся в ранги отсортированных
+// термов, пары сортируются поразрядно и сворачиваются в (docid, tf).
+struct CsrBuilder {
+    std::unordered_map<string, u32> ids;
+    std::vector<const string*> terms;
+    std::vector<u64> keys;
+
+    void add(const string& term, DocId doc, u32 times = 1) {
+        auto it = ids.emplace(term, (u32)terms.size()).first;
+        if (it->second == terms.size()) terms.push_back(&it->first);
+        keys.insert(keys.end(), times, ((u64)it->second << 32) | (u32)doc);
+    }
+
+    CsrIndex freeze() {
+        CsrIndex ix;
+        std::vector<u32> by_term(terms.size());
+        for (u32 id = 0; id < (u32)by_term.size(); id++) by_term[id] = id;
+        std::sort(by_term.begin(), by_term.end(), [&](u32 a, u32 b) { return *terms[a] < *terms[b]; });
+        std::vector<u32> rank(terms.size());
+        for (u32 r = 0; r < (u32)by_term.size(); r++) rank[by_term[r]] = r;
+        for (u64& k : keys) k = ((u64)rank[k >> 32] << 32) | (u32)k;
+        radix_sort_u64(keys);
+
+        ix.own_term_offs.reserve(terms.size() + 1);
+        ix.own_offs.reserve(terms.size() + 1);
+        ix.own_term_offs.push_back(0);
+        for (u32 id : by_term) {
+            ix.own_term_bytes.insert(ix.own_term_bytes.end(), terms[id]->begin(), terms[id]->end());
+            ix.own_term_offs.push_back(ix.own_term_bytes.size());
+        }
+        ix.own_offs.push_back(0);
+        size_t i = 0;
+        for (u32 r = 0; r < (u32)by_term.size(); r++) {
+            while (i < keys.size() && (u32)(keys[i] >> 32) == r) {
+                u32 d = (u32)keys[i];
+                u32 tf = 0;
+                for (; i < keys.size() && keys[i] == (((u64)r << 32) | d); i++) tf++;
+                ix.own_docs.push_back((DocId)d);
+                ix.own_tfs.push_back(tf);
+            }
+            ix.own_offs.push_back(ix.own_docs.size());
+        }
+        std::vector<u64>().swap(keys);
+        ids.clear();
+        terms.clear();
+        return ix;
+    }
 };
 
-static bool parse_doc_token_line(const string& line, DocId& doc, string& token) {
+// docid из lr3 идут подряд с нуля, поэтому аккумуляторы запроса — плотные
+// массивы по docid. Постинги отсортированы по (u32)docid, так что максимум
+// лежит в конце каждого списка.
+static void init_doc_span(CorpusIndex& ci) {
+    u64 span = 0;
+    for (const CsrIndex* ix : {&ci.stem_index, &ci.exact_index})
+        for (size_t t = 0; t < ix->terms; t++)
+            if (ix->offs[t + 1] > ix->offs[t]) span = std::max(span, (u64)(u32)ix->docs[ix->offs[t + 1] - 1] + 1);
+    if (span > std::max<u64>((u64)ci.num_docs * 8, (u64)1 << 26))
+        die("docids are negative or too sparse (max docid " + std::to_string(span - 1) +
+            " for " + std::to_string(ci.num_docs) + " docs)");
+    ci.doc_span = (size_t)span;
+}
+
+static inline double tf_weight(int tf) {
+    return 1.0 + std::log((double)tf);
+}
+static inline double idf_weight(int N, int df) {
+    return std::log((double)(N + 1) / (double)(df + 1)) + 1.0;
+}
+
+// Модель ранжирования над stem_index. Вклад постинга = unit * mult, где mult
+// зависит только от терма (idf), а unit — от постинга; block_unit — верхняя
+// оценка unit по блокам kBlock для Block-Max WAND. Impact: unit — заранее
+// квантованный BM25-вес постинга (1..255), mult = 1, так что очки запроса —
+// сумма целых; в выдаче они умножаются на impact_scale.
+static inline double bm25_idf(int N, u64 df) {
+    return std::log(1.0 + ((double)N - (double)df + 0.5) / ((double)df + 0.5));
+}
+static inline double bm25_tf(const RankModel& m, u32 tf, u32 len) {
+    const double t = (double)tf;
+    return t * (m.k1 + 1.0) / (t + m.k1 * (1.0 - m.b + m.b * (double)len / m.avg_doc_len));
+}
+
+static inline double term_mult(const CorpusIndex& ci, u64 df) {
+    switch (ci.model.scoring) {
+        case Scoring::Bm25: return bm25_idf(ci.num_docs, df);
+        case Scoring::Impact: return 1.0;
+        default: return idf_weight(ci.num_docs, (int)df);
+    }
+}
+
+static inline double posting_unit(const CorpusIndex& ci, u64 j) {
+    const CsrIndex& six = ci.stem_index;
+    switch (ci.model.scoring) {
+        case Scoring::Bm25: return bm25_tf(ci.model, six.tfs[j], ci.doc_len[(u32)six.docs[j]]);
+        case Scoring::Impact: return (double)ci.model.impacts[j];
+        default: return tf_weight((int)six.tfs[j]);
+    }
+}
+
+// Бонус точной формы в единицах очков модели.
+static inline double model_bonus(const CorpusIndex& ci, double bonus) {
+    return ci.model.scoring == Scoring::Impact ? std::round(bonus / ci.model.impact_scale) : bonus;
+}
+
+// Длины документов (сумма tf по stem_index, т.е. число оставленных токенов).
+static void init_doc_lengths(CorpusIndex& ci) {
+    const CsrIndex& six = ci.stem_index;
+    ci.own_doc_len.assign(ci.doc_span, 0);
+    for (size_t j = 0; j < six.postings(); j++) ci.own_doc_len[(u32)six.docs[j]] += six.tfs[j];
+    ci.doc_len = ci.own_doc_len.data();
+}
+
+// Модель, сохранённая в IRRX, берётся как есть, если совпадают схема и
+// (кроме tf-idf) k1/b; иначе всё пересчитывается проходом по постингам.
+static bool scoring_matches(const RankModel& m, const SearchConfig& cfg) {
+    return m.ready && m.scoring == cfg.scoring &&
+           (cfg.scoring == Scoring::TfIdf || (m.k1 == cfg.k1 && m.b == cfg.b));
+}
+
+static void prepare_scoring(CorpusIndex& ci, const SearchConfig& cfg) {
+    RankModel& m = ci.model;
+    if (scoring_matches(m, cfg)) return;
+    const CsrIndex& six = ci.stem_index;
+    const size_t P = six.postings();
+    m.scoring = cfg.scoring;
+    m.k1 = cfg.k1;
+    m.b = cfg.b;
+
+    u64 total = 0;
+    for (size_t d = 0; d < ci.doc_span; d++) total += ci.doc_len[d];
+    m.avg_doc_len = ci.num_docs ? std::max(1.0, (double)total / ci.num_docs) : 1.0;
+
+    if (m.scoring == Scoring::Impact) {
+        // Квантование по глобальному максимуму BM25-веса постинга.
+        std::vector<double> w(P);
+        double max_w = 0.0;
+        for (size_t t = 0; t < six.terms; t++) {
+            const double idf = bm25_idf(ci.num_docs, six.offs[t + 1] - six.offs[t]);
+            for (u64 j = six.offs[t]; j < six.offs[t + 1]; j++) {
+                w[j] = idf * bm25_tf(m, six.tfs[j], ci.doc_len[(u32)six.docs[j]]);
+                max_w = std::max(max_w, w[j]);
+            }
+        }
+        m.impact_scale = max_w > 0.0 ? max_w / 255.0 : 1.0;
+        m.own_impacts.resize(P);
+        for (size_t j = 0; j < P; j++)
+            m.own_impacts[j] = (u8)std::max(1.0, std::min(255.0, std::round(w[j] / m.impact_scale)));
+        m.impacts = m.own_impacts.data();
+    }
+
+    m.own_block_unit.assign((P + kBlock - 1) / kBlock, 0.0);
+    for (size_t k = 0; k < m.own_block_unit.size(); k++) {
+        if (m.scoring == Scoring::TfIdf) {
+            m.own_block_unit[k] = tf_weight((int)six.block_max_tf[k]);
+            continue;
+        }
+        double mx = 0.0;
+        for (u64 j = k * kBlock; j < std::min<u64>((k + 1) * kBlock, P); j++) mx = std::max(mx, posting_unit(ci, j));
+        m.own_block_unit[k] = mx;
+    }
+    m.block_unit = m.own_block_unit.data();
+    m.ready = true;
+}
+
+// Ранжированный индекс на диске (--save-index / --index): секционный формат
+// как у IRIX в lr6_index, но со своей сигнатурой:
+//   "IRRX", u32 version=1, u32 section_count, u64 section_table_off, u32 reserved;
+//   секции выровнены на 8 байт, таблица: u32 type, u32 flags, u64 offset, u64 size.
+//   META (type=4): u32 docs, u32 terms_stem, u32 terms_exact, u32 reserved;
+//                  флаги секции — kRankStemmed, kRankFoldYo.
+//   для каждого CSR (flags секции: 0 — stem, 1 — exact):
+//   TERM_OFFS (5): u64[T+1], TERMS (6): байты термов, OFFS (7): u64[T+1],
+//   DOCS (8): i32[P], TFS (9): u32[P], BLOCK_MAX (10): u32[ceil(P/64)] —
+//   max tf по блокам; если секции нет, считается при загрузке.
+//   DOC_LEN (11): u32[max docid + 1] — длины документов для BM25.
+//   Модель ранжирования, с которой индекс сохранён (необязательные):
+//   SCORING (12): u32 схема (0 tfidf, 1 bm25, 2 impact), u32 reserved,
+//                 f64 k1, b, avg_doc_len, impact_scale;
+//   BLOCK_UNIT (13): f64[ceil(P/64)] по stem_index; IMPACTS (14): u8[P] — для impact.
+// Массивы используются прямо из отображённого файла, без копирования.
+static const u32 kRankStemmed = 1u;
+static const u32 kRankFoldYo  = 2u;
+
+enum : u32 { kSecMeta = 4, kSecTermOffs = 5, kSecTerms = 6, kSecOffs = 7, kSecDocs = 8, kSecTfs = 9, kSecBlockMax = 10, kSecDocLen = 11,
+       kSecScoring = 12, kSecBlockUnit = 13, kSecImpacts = 14 };
+
+struct RankSection {
+    u32 type, flags;
+    u64 offset, size;
+};
+
+static void write_ranked_index(const string& path, const CorpusIndex& ci, u32 flags) {
+    FILE* f = std::fopen(path.c_str(), "wb");
+    if (!f) die("Cannot open ranked index for writing: " + path);
+
+    std::vector<RankSection> secs;
+    u64 off = 24;
+    auto put = [&](u32 type, u32 sflags, const void* p, size_t n) {
+        static const char zeros[8] = {0};
+        size_t pad = (size_t)((8 - off % 8) % 8);
+        if (pad) std::fwrite(zeros, 1, pad, f);
+        off += pad;
+        secs.push_back({type, sflags, off, (u64)n});
+        if (n) std::fwrite(p, 1, n, f);
+        off += n;
+    };
+
+    std::fwrite("IRRX", 1, 4, f);
+    const u32 head[2] = {1, 0};
+    const u64 table_off = 0;
+    std::fwrite(head, sizeof(u32), 2, f);
+    const u32 reserved = 0;
+    std::fwrite(&table_off, sizeof(u64), 1, f);
+    std::fwrite(&reserved, sizeof(u32), 1, f);  // заголовок 24 байта, секции с кратного 8 смещения
+
+    const u32 meta[4] = {(u32)ci.num_docs, (u32)ci.stem_index.size(), (u32)ci.exact_index.size(), 0};
+    put(kSecMeta, flags, meta, sizeof(meta));
+    const CsrIndex* ixs[2] = {&ci.stem_index, &ci.exact_index};
+    for (u32 k = 0; k < 2; k++) {
+        const CsrIndex& ix = *ixs[k];
+        put(kSecTermOffs, k, ix.term_offs, (ix.terms + 1) * sizeof(u64));
+        put(kSecTerms, k, ix.term_bytes, (size_t)ix.term_offs[ix.terms]);
+        put(kSecOffs, k, ix.offs, (ix.terms + 1) * sizeof(u64));
+        put(kSecDocs, k, ix.docs, ix.postings() * sizeof(DocId));
+        put(kSecTfs, k, ix.tfs, ix.postings() * sizeof(u32));
+        put(kSecBlockMax, k, ix.block_max_tf, (ix.postings() + kBlock - 1) / kBlock * sizeof(u32));
+    }
+    put(kSecDocLen, 0, ci.doc_len, ci.doc_span * sizeof(u32));
+
+    const RankModel& m = ci.model;
+    if (m.ready) {
+        const size_t P = ci.stem_index.postings();
+        char par[40] = {0};
+        const u32 scoring = (u32)m.scoring;
+        const double vals[4] = {m.k1, m.b, m.avg_doc_len, m.impact_scale};
+        std::memcpy(par, &scoring, 4);
+        std::memcpy(par + 8, vals, sizeof(vals));
+        put(kSecScoring, 0, par, sizeof(par));
+        put(kSecBlockUnit, 0, m.block_unit, (P + kBlock - 1) / kBlock * sizeof(double));
+        if (m.scoring == Scoring::Impact) put(kSecImpacts, 0, m.impacts, P);
+    }
+
+    const u64 toff = off;
+    for (const auto& s : secs) {
+        std::fwrite(&s.type, sizeof(u32), 1, f);
+        std::fwrite(&s.flags, sizeof(u32), 1, f);
+        std::fwrite(&s.offset, sizeof(u64), 1, f);
+        std::fwrite(&s.size, sizeof(u64), 1, f);
+    }
+    const u32 count = (u32)secs.size();
+    std::fseek(f, 8, SEEK_SET);
+    std::fwrite(&count, sizeof(u32), 1, f);
+    std::fwrite(&toff, sizeof(u64), 1, f);
+    if (std::fclose(f) != 0) die("Failed writing ranked index: " + path);
+}
+
+static u32 load_ranked_index(const string& path, CorpusIndex& ci) {
+    ci.file.reset(new MappedFile);
+    if (!ci.file->open(path)) die("Cannot open ranked index: " + path);
+    const char* base = ci.file->data;
+    const size_t size = ci.file->size;
+
+    if (size < 24 || std::memcmp(base, "IRRX", 4) != 0) die("ranked index: bad magic, expected IRRX");
+    u32 version, count;
+    u64 table_off;
+    std::memcpy(&version, base + 4, 4);
+    std::memcpy(&count, base + 8, 4);
+    std::memcpy(&table_off, base + 12, 8);
+    if (version != 1) die("ranked index: unsupported version (expected 1)");
+    if (table_off > size || (u64)count * 24 > size - table_off) die("ranked index: bad section table");
+
+    auto section = [&](u32 type, u32 sflags, size_t elem, u64& n, bool required = true) -> const char* {
+        for (u32 k = 0; k < count; k++) {
+            const char* e = base + table_off + (u64)k * 24;
+            RankSection s;
+            std::memcpy(&s.type, e, 4);
+            std::memcpy(&s.flags, e + 4, 4);
+            std::memcpy(&s.offset, e + 8, 8);
+            std::memcpy(&s.size, e + 16, 8);
+            if (s.type != type || (type != kSecMeta && s.flags != sflags)) continue;
+            if (s.offset > size || s.size > size - s.offset || s.offset % 8 || s.size % elem)
+                die("ranked index: section out of file");
+            n = s.size / elem;
+            return base + s.offset;
+        }
+        if (required) die("ranked index: missing section " + std::to_string(type));
+        n = 0;
+        return nullptr;
+    };
+
+    u64 n = 0;
+    u32 meta[4];
+    const char* meta_p = section(kSecMeta, 0, 1, n);
+    if (n < sizeof(meta)) die("ranked index: META too short");
+    std::memcpy(meta, meta_p, sizeof(meta));
+    u32 flags = 0;
+    for (u32 k = 0; k < count; k++) {
+        u32 type;
+        std::memcpy(&type, base + table_off + (u64)k * 24, 4);
+        if (type == kSecMeta) std::memcpy(&flags, base + table_off + (u64)k * 24 + 4, 4);
+    }
+    ci.num_docs = (int)meta[0];
+
+    CsrIndex* ixs[2] = {&ci.stem_index, &ci.exact_index};
+    for (u32 k = 0; k < 2; k++) {
+        CsrIndex& ix = *ixs[k];
+        u64 n_toffs, n_tbytes, n_offs, n_docs, n_tfs;
+        ix.term_offs = (const u64*)section(kSecTermOffs, k, sizeof(u64), n_toffs);
+        ix.term_bytes = section(kSecTerms, k, 1, n_tbytes);
+        ix.offs = (const u64*)section(kSecOffs, k, sizeof(u64), n_offs);
+        ix.docs = (const DocId*)section(kSecDocs, k, sizeof(DocId), n_docs);
+        ix.tfs = (const u32*)section(kSecTfs, k, sizeof(u32), n_tfs);
+        ix.terms = (size_t)meta[1 + k];
+        if (n_toffs != ix.terms + 1 || n_offs != ix.terms + 1 || n_docs != n_tfs ||
+            ix.term_offs[ix.terms] != n_tbytes || ix.offs[ix.terms] != n_docs)
+            die("ranked index: inconsistent section sizes");
+        u64 n_blocks;
+        ix.block_max_tf = (const u32*)section(kSecBlockMax, k, sizeof(u32), n_blocks, false);
+        if (!ix.block_max_tf) {
+            ix.build_block_max(ix.tfs, n_tfs);
+            ix.block_max_tf = ix.own_block_max_tf.data();
+        } else if (n_blocks != (n_tfs + kBlock - 1) / kBlock) {
+            die("ranked index: inconsistent section sizes");
+        }
+        for (size_t t = 0; t < ix.terms; t++)
+            if (ix.term_offs[t] > ix.term_offs[t + 1] || ix.offs[t] > ix.offs[t + 1])
+                die("ranked index: offsets are not monotonic");
+        // init_doc_span берёт максимум docid из конца списка, а курсоры DAAT
+        // ищут по нему бинарным поиском: docid терма строго возрастают с нуля.
+        for (size_t t = 0; t < ix.terms; t++) {
+            DocId prev = -1;
+            for (u64 j = ix.offs[t]; j < ix.offs[t + 1]; j++) {
+                if (ix.docs[j] <= prev) die("ranked index: postings are not ascending docids");
+                prev = ix.docs[j];
+            }
+        }
+    }
+    init_doc_span(ci);
+    u64 n_len;
+    ci.doc_len = (const u32*)section(kSecDocLen, 0, sizeof(u32), n_len, false);
+    if (!ci.doc_len) init_doc_lengths(ci);
+    else if (n_len != ci.doc_span) die("ranked index: inconsistent section sizes");
+
+    u64 n_par;
+    const char* par = section(kSecScoring, 0, 1, n_par, false);
+    if (par) {
+        RankModel& m = ci.model;
+        const u64 P = ci.stem_index.postings();
+        u32 scoring;
+        double vals[4];
+        std::memcpy(&scoring, par, 4);
+        if (n_par != 40 || scoring > (u32)Scoring::Impact) die("ranked index: bad SCORING section");
+        std::memcpy(vals, par + 8, sizeof(vals));
+        m.scoring = (Scoring)scoring;
+        m.k1 = vals[0];
+        m.b = vals[1];
+        m.avg_doc_len = vals[2];
+        m.impact_scale = vals[3];
+        u64 n_units, n_imp = 0;
+        m.block_unit = (const double*)section(kSecBlockUnit, 0, sizeof(double), n_units);
+        if (m.scoring == Scoring::Impact) m.impacts = (const u8*)section(kSecImpacts, 0, 1, n_imp);
+        if (n_units != (P + kBlock - 1) / kBlock || (m.scoring == Scoring::Impact && n_imp != P))
+            die("ranked index: inconsistent section sizes");
+        m.ready = true;
+    }
+    return flags;
+}
+
+// "docid\ttoken[\tfield]": колонка id поля есть у lr3 --fields.
+static bool parse_doc_token_line(const string& line, DocId& doc, string& token, u32& field) {
     std::istringstream iss(line);
     if (!(iss >> doc)) return false;
     if (!(iss >> token)) return false;
+    if (!(iss >> field)) field = 0;
     return true;
 }
 
-static CorpusIndex build_index_from_tokens(const SearchConfig& cfg) {
+static CorpusIndex build_index_from_tokens(const SearchConfig& cfg, u32* rank_flags) {
     CorpusIndex ci;
+    CsrBuilder stem_b, exact_b;
+    std::unordered_set<DocId> all_docs;
 
-    std::ifstream in(cfg.tokens_path);
-    if (!in) {
-        std::cerr << "ERROR: cannot open tokens file: " << cfg.tokens_path << "\n";
-        std::exit(1);
-    }
-
-    string line;
     long long lines = 0;
     long long kept = 0;
 
-    while (std::getline(in, line)) {
-        lines++;
-        line = trim(line);
-        if (line.empty()) continue;
-
-        DocId doc;
-        string tok;
-        if (!parse_doc_token_line(line, doc, tok)) continue;
-
+    // Токены доп. полей (id > 0) идут в stem_index с весом field_boost, так
+    // что совпадение в заголовке весит больше; длины документов для BM25
+    // считаются по тем же весам. exact_index нужен только для бонуса.
+    auto add_token = [&](DocId doc, u32 field, const string& tok) {
         string exact = normalize_token_bytes(tok);
-        if (exact.size() < 2) continue;
+        if (exact.size() < 2) return;
 
-        if (exact.size() > 64) continue;
+        if (exact.size() > 64) return;
 
         string stem = stem_term(exact, cfg.enable_stem);
 
-        ci.all_docs.insert(doc);
-        ci.exact_index[exact][doc] += 1;
-        ci.stem_index[stem][doc] += 1;
+        all_docs.insert(doc);
+        exact_b.add(exact, doc);
+        stem_b.add(stem, doc, field ? cfg.field_boost : 1u);
 
         kept++;
+    };
+
+    u32 stream_flags = 0;
+    const bool tokens_bin = is_token_stream_bin(cfg.tokens_path, &stream_flags);
+    // Текстовый поток режим ё не хранит — его задаёт --yo.
+    bool fold_yo = tokens_bin ? (stream_flags & kTsFoldYo) != 0 : cfg.fold_yo == 1;
+    if (tokens_bin && cfg.fold_yo >= 0 && (cfg.fold_yo == 1) != fold_yo)
+        die(string("--yo ") + (cfg.fold_yo ? "1" : "0") + " does not match the token stream header");
+    init_fold_tables(fold_yo);
+    *rank_flags = (cfg.enable_stem ? kRankStemmed : 0u) | (fold_yo ? kRankFoldYo : 0u);
+
+    if (tokens_bin) {
+        read_token_stream_bin(cfg.tokens_path, [&](u64 doc, u32 field, const char* p, size_t len) {
+            lines++;
+            add_token((DocId)doc, field, string(p, len));
+        });
+    } else {
+        std::ifstream in(cfg.tokens_path);
+        if (!in) {
+            std::cerr << "ERROR: cannot open tokens file: " << cfg.tokens_path << "\n";
+            std::exit(1);
+        }
+
+        string line;
+        while (std::getline(in, line)) {
+            lines++;
+            line = trim(line);
+            if (line.empty()) continue;
+
+            DocId doc;
+            string tok;
+            u32 field = 0;
+            if (!parse_doc_token_line(line, doc, tok, field)) continue;
+            add_token(doc, field, tok);
+        }
     }
 
-    std::cerr << "Index built: docs=" << ci.all_docs.size()
+    ci.num_docs = (int)all_docs.size();
+    ci.exact_index = exact_b.freeze();
+    ci.stem_index = stem_b.freeze();
+    ci.exact_index.bind_owned();
+    ci.stem_index.bind_owned();
+    ci.stemmed = cfg.enable_stem;
+    init_doc_span(ci);
+    init_doc_lengths(ci);
+
+    std::cerr << "Index built: docs=" << ci.num_docs
               << ", lines=" << lines
               << ", kept=" << kept
               << ", stem_terms=" << ci.stem_index.size()
               << ", exact_terms=" << ci.exact_index.size()
+              << ", postings=" << ci.stem_index.postings() << "+" << ci.exact_index.postings()
+              << ", bytes=" << ci.stem_index.bytes() + ci.exact_index.bytes()
               << "\n";
     return ci;
 }
 
-static inline double tf_weight(int tf) {
-    return 1.0 + std::log((double)tf);
-}
-static inline double idf_weight(int N, int df) {
-    return std::log((double)(N + 1) / (double)(df + 1)) + 1.0;
-}
-
 static std::vector<string> split_query_into_terms(const string& q) {
     
     std::vector<string> out;
@@ -234,89 +774,351 @@ struct Hit {
     double score;
 };
 
-static std::vector<Hit> search_query(
+// Аккумуляторы очков, общие для всех запросов сессии: слот документа
+// действителен, только если его epoch равен текущему, так что сброс между
+// запросами — инкремент счётчика, а не очистка массива.
+// Impact копит целые единицы в units вместо score.
+struct ScoreAccumulator {
+    std::vector<double> score;
+    std::vector<int32_t> units;
+    std::vector<u32> epoch;
+    std::vector<DocId> touched;  // документы текущего запроса
+    u32 cur = 0;
+    bool integer = false;
+    u64 postings_total = 0, postings_scored = 0;  // по всем запросам сессии
+
+    void begin(size_t span, bool integer_) {
+        integer = integer_;
+        if (epoch.size() < span) {
+            epoch.assign(span, 0);
+            cur = 0;
+        }
+        if (integer && units.size() < span) units.assign(span, 0);
+        if (!integer && score.size() < span) score.assign(span, 0.0);
+        if (++cur == 0) {
+            std::fill(epoch.begin(), epoch.end(), 0);
+            cur = 1;
+        }
+        touched.clear();
+    }
+
+    void add(DocId d, double v) {
+        u32 i = (u32)d;
+        if (epoch[i] != cur) {
+            epoch[i] = cur;
+            score[i] = v;
+            touched.push_back(d);
+        } else {
+            score[i] += v;
+        }
+    }
+
+    void add_units(DocId d, int32_t v) {
+        u32 i = (u32)d;
+        if (epoch[i] != cur) {
+            epoch[i] = cur;
+            units[i] = v;
+            touched.push_back(d);
+        } else {
+            units[i] += v;
+        }
+    }
+
+    bool has(DocId d) const { return epoch[(u32)d] == cur; }
+    double value(DocId d) const { return integer ? (double)units[(u32)d] : score[(u32)d]; }
+};
+
+static inline bool hit_better(const Hit& a, const Hit& b) {
+    if (a.score != b.score) return a.score > b.score;
+    return a.doc < b.doc;
+}
+
+// Top-k через ограниченную кучу: в вершине худший из отобранных, полная
+// сортировка — только для k итоговых.
+static std::vector<Hit> select_topk(const ScoreAccumulator& acc, int k) {
+    std::vector<Hit> heap;
+    if (k <= 0) return heap;
+    heap.reserve(std::min(acc.touched.size(), (size_t)k));
+    for (DocId d : acc.touched) {
+        Hit h{d, acc.value(d)};
+        if ((int)heap.size() < k) {
+            heap.push_back(h);
+            std::push_heap(heap.begin(), heap.end(), hit_better);
+        } else if (hit_better(h, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), hit_better);
+            heap.back() = h;
+            std::push_heap(heap.begin(), heap.end(), hit_better);
+        }
+    }
+    std::sort_heap(heap.begin(), heap.end(), hit_better);
+    return heap;
+}
+
+// Курсор DAAT по постингам одного терма. Блоки — глобальная сетка по kBlock
+// постингов массива docs; block_unit блока покрывает и соседний терм на
+// границе, так что оценка лишь грубее, но остаётся верхней.
+static const u32 kNoMoreDocs = std::numeric_limits<u32>::max();
+
+struct TermCursor {
+    const DocId* docs;
+    const double* block_unit;
+    u64 pos, end;
+    double mult, max_score;
+    double bonus_bound;  // бонус точных форм, приписанный этому терму
+    u64 cached_block = ~(u64)0;
+    double cached_score = 0.0;
+
+    u32 doc() const { return pos < end ? (u32)docs[pos] : kNoMoreDocs; }
+    u64 block_end() const { return std::min((pos / kBlock + 1) * kBlock, end); }
+    u32 block_last() const { return (u32)docs[block_end() - 1]; }
+    double block_score() {
+        if (pos / kBlock != cached_block) {
+            cached_block = pos / kBlock;
+            cached_score = block_unit[cached_block] * mult + bonus_bound;
+        }
+        return cached_score;
+    }
+
+    // Переход к блоку, где может встретиться d; сам курсор может остаться < d.
+    void shallow(u32 d) {
+        while (pos < end && block_last() < d) pos = block_end();
+    }
+
+    void seek(u32 d) {
+        if (doc() >= d) return;
+        shallow(d);
+        if (pos < end) pos = (u64)(std::lower_bound(docs + pos, docs + block_end(), (DocId)d) - docs);
+    }
+};
+
+// Оценки суммируются в некотором порядке, а очки — в порядке запроса,
+// поэтому сравнение с порогом чуть ослаблено против ошибок округления.
+// Целые суммы Impact точны, и там равная порогу оценка отсекается.
+static inline bool may_beat(double bound, double theta, double slack) {
+    return bound * (1.0 + slack) + slack * 1e-3 > theta;
+}
+
+// WAND / Block-Max WAND: документы по возрастанию docid, полностью считаются
+// только те, чья верхняя оценка превышает k-й результат. Ничья по очкам
+// решается меньшим docid, а все следующие docid больше, поэтому равная
+// порогу оценка уже не проходит. Очки суммируются в том же порядке, что и
+// в exhaustive, — результат совпадает побитово.
+static std::vector<Hit> search_daat(
     const CorpusIndex& ci,
     const SearchConfig& cfg,
-    const string& query_text
+    const std::vector<string>& q_stem,
+    const std::vector<string>& q_exact,
+    ScoreAccumulator& acc
 ) {
-    const int N = (int)ci.all_docs.size();
-    if (N == 0) return {};
+    const CsrIndex& six = ci.stem_index;
+    const CsrIndex& eix = ci.exact_index;
+    const double* block_unit = ci.model.block_unit;
+    const u8* impacts = ci.model.impacts;
+    const bool use_blocks = cfg.retrieval == Retrieval::BlockMaxWand;
+    const bool integer = ci.model.scoring == Scoring::Impact;
+    const double slack = integer ? 0.0 : 1e-9;
+
+    // Если стемминг запроса совпадает с индексом, документ с точной формой
+    // q_exact[i] обязательно есть в постингах q_stem[i], и бонус входит в
+    // оценку этого терма. Иначе (no_stem в --compare по стемленому индексу)
+    // он добавляется к любой оценке целиком.
+    const bool paired = cfg.enable_stem == ci.stemmed;
+    const double exact_bonus = model_bonus(ci, cfg.exact_bonus);
+    const double bonus = std::max(exact_bonus, 0.0);
+    double bonus_bound = 0.0;
+
+    std::vector<TermCursor> terms;
+    std::vector<TermCursor> exact;
+    for (size_t i = 0; i < q_stem.size(); i++) {
+        int te = exact_bonus != 0.0 ? eix.find(q_exact[i]) : -1;
+        if (te >= 0) exact.push_back({eix.docs, nullptr, eix.offs[te], eix.offs[te + 1], 0.0, 0.0, 0.0});
+
+        int t = six.find(q_stem[i]);
+        const u64 b = t < 0 ? 0 : six.offs[t], e = t < 0 ? 0 : six.offs[t + 1];
+        if (b == e) {
+            if (te >= 0) bonus_bound += bonus;
+            continue;
+        }
+        double mult = term_mult(ci, e - b);
+        double max_unit = 0.0;
+        for (u64 k = b / kBlock; k <= (e - 1) / kBlock; k++) max_unit = std::max(max_unit, block_unit[k]);
+        double own_bonus = te < 0 ? 0.0 : bonus;
+        if (!paired) {
+            bonus_bound += own_bonus;
+            own_bonus = 0.0;
+        }
+        terms.push_back({six.docs, block_unit, b, e, mult, max_unit * mult + own_bonus, own_bonus});
+        acc.postings_total += e - b;
+    }
+    if (terms.empty()) return {};
 
-    
-    auto raw_terms = split_query_into_terms(query_text);
+    const size_t k = (size_t)std::max(cfg.topk, 0);
+    std::vector<Hit> heap;
+    if (k == 0) return heap;
+    heap.reserve(k);
 
-    std::vector<string> q_exact;
-    std::vector<string> q_stem;
+    std::vector<TermCursor*> ord;
+    for (auto& c : terms) ord.push_back(&c);
 
-    q_exact.reserve(raw_terms.size());
-    q_stem.reserve(raw_terms.size());
+    while (true) {
+        std::sort(ord.begin(), ord.end(), [](const TermCursor* a, const TermCursor* b) { return a->doc() < b->doc(); });
+        while (!ord.empty() && ord.back()->doc() == kNoMoreDocs) ord.pop_back();
+        if (ord.empty()) break;
+
+        const bool full = heap.size() == k;
+        const double theta = full ? heap.front().score : -std::numeric_limits<double>::infinity();
+
+        // Pivot: первый курсор, на котором сумма max_score может побить порог.
+        double bound = bonus_bound;
+        size_t pivot = ord.size();
+        for (size_t i = 0; i < ord.size(); i++) {
+            bound += ord[i]->max_score;
+            if (may_beat(bound, theta, slack)) { pivot = i; break; }
+        }
+        if (pivot == ord.size()) break;
+        const u32 p = ord[pivot]->doc();
+        size_t last = pivot;
+        while (last + 1 < ord.size() && ord[last + 1]->doc() == p) last++;
+
+        if (use_blocks && full) {
+            double block_bound = bonus_bound;
+            for (size_t i = 0; i <= last; i++) {
+                ord[i]->shallow(p);
+                if (ord[i]->pos < ord[i]->end) block_bound += ord[i]->block_score();
+            }
+            if (!may_beat(block_bound, theta, slack)) {
+                // До конца самого короткого из текущих блоков оценка та же.
+                u32 next = last + 1 < ord.size() ? ord[last + 1]->doc() : kNoMoreDocs;
+                for (size_t i = 0; i <= last; i++)
+                    if (ord[i]->pos < ord[i]->end) next = std::min(next, ord[i]->block_last() + 1);
+                for (size_t i = 0; i <= last; i++) ord[i]->seek(next);
+                continue;
+            }
+        }
 
-    for (const auto& t : raw_terms) {
-        string ex = normalize_token_bytes(t);
-        if (ex.size() < 2) continue;
-        if (ex.size() > 64) continue;
+        bool aligned = true;
+        for (size_t i = 0; i <= last; i++) aligned = aligned && ord[i]->doc() == p;
+        if (!aligned) {
+            for (size_t i = 0; i <= last; i++) ord[i]->seek(p);
+            continue;
+        }
 
-        q_exact.push_back(ex);
-        q_stem.push_back(stem_term(ex, cfg.enable_stem));
+        double s = 0.0;
+        int32_t units = 0;
+        for (auto& c : terms) {
+            if (c.doc() != p) continue;
+            if (integer) units += impacts[c.pos];
+            else s += posting_unit(ci, c.pos) * c.mult;
+            acc.postings_scored++;
+        }
+        for (auto& c : exact) {
+            c.seek(p);
+            if (c.doc() != p) continue;
+            if (integer) units += (int32_t)exact_bonus;
+            else s += exact_bonus;
+        }
+        if (integer) s = (double)units;
+
+        Hit h{(DocId)p, s};
+        if (!full) {
+            heap.push_back(h);
+            std::push_heap(heap.begin(), heap.end(), hit_better);
+        } else if (hit_better(h, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), hit_better);
+            heap.back() = h;
+            std::push_heap(heap.begin(), heap.end(), hit_better);
+        }
+        for (size_t i = 0; i <= last; i++) ord[i]->pos++;
     }
 
-    
-    std::unordered_set<DocId> candidates;
-    candidates.reserve(4096);
+    std::sort_heap(heap.begin(), heap.end(), hit_better);
+    return heap;
+}
 
-    for (const auto& st : q_stem) {
-        auto it = ci.stem_index.find(st);
-        if (it == ci.stem_index.end()) continue;
-        for (const auto& kv : it->second) candidates.insert(kv.first);
-    }
+static std::vector<Hit> search_exhaustive(
+    const CorpusIndex& ci,
+    const SearchConfig& cfg,
+    const std::vector<string>& q_stem,
+    const std::vector<string>& q_exact,
+    ScoreAccumulator& acc
+) {
+    const CsrIndex& six = ci.stem_index;
+    const CsrIndex& eix = ci.exact_index;
 
-    
-    std::unordered_map<DocId, double> score;
-    score.reserve(candidates.size() * 2 + 1);
+    const bool integer = ci.model.scoring == Scoring::Impact;
+    acc.begin(ci.doc_span, integer);
 
     
     for (size_t i = 0; i < q_stem.size(); i++) {
-        const auto& st = q_stem[i];
-        auto it = ci.stem_index.find(st);
-        if (it == ci.stem_index.end()) continue;
+        int t = six.find(q_stem[i]);
+        if (t < 0) continue;
 
-        int df = (int)it->second.size();
-        double idf = idf_weight(N, df);
+        const u64 b = six.offs[t], e = six.offs[t + 1];
+        double mult = term_mult(ci, e - b);
+        acc.postings_total += e - b;
+        acc.postings_scored += e - b;
 
-        for (const auto& kv : it->second) {
-            DocId d = kv.first;
-            int tf = kv.second;
-            score[d] += tf_weight(tf) * idf;
+        if (integer) {
+            const u8* impacts = ci.model.impacts;
+            for (u64 j = b; j < e; j++) acc.add_units(six.docs[j], impacts[j]);
+        } else {
+            for (u64 j = b; j < e; j++) acc.add(six.docs[j], posting_unit(ci, j) * mult);
         }
     }
 
     
-    if (cfg.exact_bonus != 0.0) {
+    const double exact_bonus = model_bonus(ci, cfg.exact_bonus);
+    if (exact_bonus != 0.0) {
         for (const auto& ex : q_exact) {
-            auto it = ci.exact_index.find(ex);
-            if (it == ci.exact_index.end()) continue;
+            int t = eix.find(ex);
+            if (t < 0) continue;
 
             
-            for (const auto& kv : it->second) {
-                DocId d = kv.first;
-                if (score.find(d) != score.end()) {
-                    score[d] += cfg.exact_bonus;
-                }
+            for (u64 j = eix.offs[t]; j < eix.offs[t + 1]; j++) {
+                DocId d = eix.docs[j];
+                if (!acc.has(d)) continue;
+                if (integer) acc.units[(u32)d] += (int32_t)exact_bonus;
+                else acc.score[(u32)d] += exact_bonus;
             }
         }
     }
 
+    return select_topk(acc, cfg.topk);
+}
+
+static std::vector<Hit> search_query(
+    const CorpusIndex& ci,
+    const SearchConfig& cfg,
+    const string& query_text,
+    ScoreAccumulator& acc
+) {
+    const int N = ci.num_docs;
+    if (N == 0) return {};
+
     
-    std::vector<Hit> hits;
-    hits.reserve(score.size());
-    for (const auto& kv : score) hits.push_back({kv.first, kv.second});
+    auto raw_terms = split_query_into_terms(query_text);
+
+    std::vector<string> q_exact;
+    std::vector<string> q_stem;
+
+    q_exact.reserve(raw_terms.size());
+    q_stem.reserve(raw_terms.size());
+
+    for (const auto& t : raw_terms) {
+        string ex = normalize_token_bytes(t);
+        if (ex.size() < 2) continue;
+        if (ex.size() > 64) continue;
 
-    std::sort(hits.begin(), hits.end(), [](const Hit& a, const Hit& b) {
-        if (a.score != b.score) return a.score > b.score;
-        return a.doc < b.doc;
-    });
+        q_exact.push_back(ex);
+        q_stem.push_back(stem_term(ex, cfg.enable_stem));
+    }
 
-    if ((int)hits.size() > cfg.topk) hits.resize(cfg.topk);
+    
+    std::vector<Hit> hits = cfg.retrieval == Retrieval::Exhaustive
+        ? search_exhaustive(ci, cfg, q_stem, q_exact, acc)
+        : search_daat(ci, cfg, q_stem, q_exact, acc);
+    if (ci.model.scoring == Scoring::Impact)
+        for (auto& h : hits) h.score *= ci.model.impact_scale;
     return hits;
 }
 
@@ -335,6 +1137,13 @@ static void usage(const char* argv0) {
         << "Usage:\n"
         << "  " << argv0 << " --tokens tokens.txt [--topk 10] [--bonus 0.5] [--no-stem] [\"query text\"]\n"
         << "  " << argv0 << " --tokens tokens.txt --compare queries.txt [--out compare.tsv] [--topk 10] [--bonus 0.5]\n"
+        << "  " << argv0 << " --tokens tokens.txt --save-index ranked.bin [--no-stem] [--scoring ...]\n"
+        << "  " << argv0 << " --index ranked.bin [--compare queries.txt ...] [\"query text\"]\n"
+        << "  (any mode) --retrieval exhaustive|wand|bmw   (default bmw; same top-k, fewer postings scored)\n"
+        << "  (any mode) --scoring tfidf|bm25|impact [--k1 1.2] [--b 0.75]   (default tfidf)\n"
+        << "    --save-index stores the model; --index reuses it when --scoring/--k1/--b match\n"
+        << "  --yo 1   tokens.txt comes from lr3_token --yo 1 (text has no header to say so)\n"
+        << "  --field-boost 2   tf weight of tokens from lr3 --fields extra fields (title etc.)\n"
         << "\n"
         << "Examples:\n"
         << "  " << argv0 << " --tokens tokens.txt\n"
@@ -353,6 +1162,7 @@ int main(int argc, char** argv) {
     bool compare_mode = false;
     string compare_path;
     string out_path = "compare.tsv";
+    string index_path, save_index_path;
 
     for (int i = 1; i < argc; i++) {
         string a = argv[i];
@@ -364,11 +1174,35 @@ int main(int argc, char** argv) {
             cfg.exact_bonus = std::atof(argv[++i]);
         } else if (a == "--no-stem") {
             cfg.enable_stem = false;
+        } else if (a == "--retrieval" && i+1 < argc) {
+            string r = argv[++i];
+            if (r == "exhaustive") cfg.retrieval = Retrieval::Exhaustive;
+            else if (r == "wand") cfg.retrieval = Retrieval::Wand;
+            else if (r == "bmw") cfg.retrieval = Retrieval::BlockMaxWand;
+            else die("--retrieval must be exhaustive, wand or bmw");
+        } else if (a == "--scoring" && i+1 < argc) {
+            string m = argv[++i];
+            if (m == "tfidf") cfg.scoring = Scoring::TfIdf;
+            else if (m == "bm25") cfg.scoring = Scoring::Bm25;
+            else if (m == "impact") cfg.scoring = Scoring::Impact;
+            else die("--scoring must be tfidf, bm25 or impact");
+        } else if (a == "--yo" && i+1 < argc) {
+            cfg.fold_yo = std::atoi(argv[++i]) != 0 ? 1 : 0;
+        } else if (a == "--field-boost" && i+1 < argc) {
+            cfg.field_boost = (u32)std::max(1, std::atoi(argv[++i]));
+        } else if (a == "--k1" && i+1 < argc) {
+            cfg.k1 = std::max(0.0, std::atof(argv[++i]));
+        } else if (a == "--b" && i+1 < argc) {
+            cfg.b = std::min(1.0, std::max(0.0, std::atof(argv[++i])));
         } else if (a == "--compare" && i+1 < argc) {
             compare_mode = true;
             compare_path = argv[++i];
         } else if (a == "--out" && i+1 < argc) {
             out_path = argv[++i];
+        } else if (a == "--index" && i+1 < argc) {
+            index_path = argv[++i];
+        } else if (a == "--save-index" && i+1 < argc) {
+            save_index_path = argv[++i];
         } else if (a == "--help" || a == "-h") {
             usage(argv[0]);
             return 0;
@@ -379,16 +1213,47 @@ int main(int argc, char** argv) {
         }
     }
 
-    if (!file_exists(cfg.tokens_path)) {
-        std::cerr << "ERROR: tokens file not found: " << cfg.tokens_path << "\n";
-        std::cerr << "Tip: run from the directory where tokens.txt is located, or pass --tokens path/to/tokens.txt\n";
-        return 1;
+    if (!index_path.empty() && !save_index_path.empty()) die("--index and --save-index are mutually exclusive");
+
+    CorpusIndex ci;
+    if (!index_path.empty()) {
+        // Индекс уже собран: стемминг при сборке должен совпадать с текущим,
+        // свёртка ё -> е берётся из файла.
+        u32 flags = load_ranked_index(index_path, ci);
+        if (((flags & kRankStemmed) != 0) != cfg.enable_stem)
+            die(string("ranked index was built ") + ((flags & kRankStemmed) ? "with" : "without") +
+                " stemming; rebuild it or " + ((flags & kRankStemmed) ? "drop" : "pass") + " --no-stem");
+        if (cfg.fold_yo >= 0 && (cfg.fold_yo == 1) != ((flags & kRankFoldYo) != 0))
+            die(string("ranked index was built with --yo ") + ((flags & kRankFoldYo) ? "1" : "0"));
+        init_fold_tables((flags & kRankFoldYo) != 0);
+        ci.stemmed = (flags & kRankStemmed) != 0;
+        if (ci.model.ready && !scoring_matches(ci.model, cfg))
+            std::cerr << "NOTE: index was saved with other --scoring/--k1/--b, recomputing scores\n";
+        std::cerr << "Index loaded: docs=" << ci.num_docs
+                  << ", stem_terms=" << ci.stem_index.size()
+                  << ", exact_terms=" << ci.exact_index.size()
+                  << ", postings=" << ci.stem_index.postings() << "+" << ci.exact_index.postings()
+                  << "\n";
+    } else {
+        if (!file_exists(cfg.tokens_path)) {
+            std::cerr << "ERROR: tokens file not found: " << cfg.tokens_path << "\n";
+            std::cerr << "Tip: run from the directory where tokens.txt is located, or pass --tokens path/to/tokens.txt\n";
+            return 1;
+        }
+
+        u32 flags = 0;
+        ci = build_index_from_tokens(cfg, &flags);
+        if (!save_index_path.empty()) {
+            prepare_scoring(ci, cfg);
+            write_ranked_index(save_index_path, ci, flags);
+            std::cerr << "OK: wrote " << save_index_path << "\n";
+            if (!compare_mode && query_arg.empty()) return 0;
+        }
     }
 
-    
-    CorpusIndex ci = build_index_from_tokens(cfg);
+    prepare_scoring(ci, cfg);
+    ScoreAccumulator acc;
 
-    
     if (compare_mode) {
         if (compare_path.empty() || !file_exists(compare_path)) {
             std::cerr << "ERROR: compare queries file not found: " << compare_path << "\n";
@@ -413,7 +1278,7 @@ int main(int argc, char** argv) {
             {
                 SearchConfig c0 = cfg;
                 c0.enable_stem = false;
-                auto hits0 = search_query(ci, c0, qline);
+                auto hits0 = search_query(ci, c0, qline, acc);
                 for (size_t r = 0; r < hits0.size(); r++) {
                     out << qline << "\tno_stem\t" << (r+1) << "\t" << hits0[r].doc << "\t" << hits0[r].score << "\n";
                 }
@@ -422,20 +1287,21 @@ int main(int argc, char** argv) {
             {
                 SearchConfig c1 = cfg;
                 c1.enable_stem = true;
-                auto hits1 = search_query(ci, c1, qline);
+                auto hits1 = search_query(ci, c1, qline, acc);
                 for (size_t r = 0; r < hits1.size(); r++) {
                     out << qline << "\tstem\t" << (r+1) << "\t" << hits1[r].doc << "\t" << hits1[r].score << "\n";
                 }
             }
         }
 
-        std::cerr << "OK: wrote " << out_path << "\n";
+        std::cerr << "OK: wrote " << out_path
+                  << " (scored " << acc.postings_scored << " of " << acc.postings_total << " postings)\n";
         return 0;
     }
 
     
     if (!query_arg.empty()) {
-        auto hits = search_query(ci, cfg, query_arg);
+        auto hits = search_query(ci, cfg, query_arg, acc);
         print_hits(hits);
         return 0;
     }
@@ -443,8 +1309,9 @@ int main(int argc, char** argv) {
     
     std::cerr
         << "Interactive search.\n"
-        << "Tokens: " << cfg.tokens_path << "\n"
+        << "Index: " << (index_path.empty() ? cfg.tokens_path : index_path) << "\n"
         << "Stem: " << (cfg.enable_stem ? "ON" : "OFF")
+        << ", scoring=" << (cfg.scoring == Scoring::TfIdf ? "tfidf" : cfg.scoring == Scoring::Bm25 ? "bm25" : "impact")
         << ", exact_bonus=" << cfg.exact_bonus
         << ", topk=" << cfg.topk << "\n"
         << "Type query and press Enter. Empty line or :q to quit.\n";
@@ -456,7 +1323,7 @@ int main(int argc, char** argv) {
         q = trim(q);
         if (q.empty() || q == ":q" || q == "quit" || q == "exit") break;
 
-        auto hits = search_query(ci, cfg, q);
+        auto hits = search_query(ci, cfg, q, acc);
         print_hits(hits);
     }
 
@@ -11,6 +11,11 @@
 #include <string>
 #include <vector>
 
+#include "fold.h"
+#include "irix.h"
+#include "radix_sort.h"
+#include "token_stream.h"
+
 using u8  = uint8_t;
 using u16 = uint16_t;
 using u32 = uint32_t;
@@ -25,25 +30,11 @@ static inline bool is_space(char c) {
     return c==' ' || c=='\t' || c=='\r' || c=='\n' || c=='\f' || c=='\v';
 }
 
-static std::string to_lower_ascii(std::string s) {
-    for (char& ch : s) {
-        unsigned char u = (unsigned char)ch;
-        if (u >= 'A' && u <= 'Z') ch = char(u - 'A' + 'a');
-    }
-    return s;
-}
-
 struct TokenPair {
     std::string term;
     u32 doc;
 };
 
-struct DictEntry {
-    std::string term;
-    u32 df;
-    u64 postings_off;
-};
-
 static bool parse_tokens_line(const std::string& line, u32& docId, std::string& token) {
 
     size_t i = 0;
@@ -75,54 +66,51 @@ static bool parse_tokens_line(const std::string& line, u32& docId, std::string&
     return !token.empty();
 }
 
-static int hexval(char c) {
-    if (c >= '0' && c <= '9') return (c - '0');
-    if (c >= 'a' && c <= 'f') return 10 + (c - 'a');
-    if (c >= 'A' && c <= 'F') return 10 + (c - 'A');
-    return -1;
+// Потоки lr3_token --emit_ids (IRTI) и --vocab (IRVC) описаны в token_stream.h.
+static bool is_term_id_stream(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    char m[4];
+    return in.read(m, 4) && std::memcmp(m, "IRTI", 4) == 0;
 }
 
-
-static std::string percent_decode(const std::string& s) {
-    std::string out;
-    out.reserve(s.size());
-    for (size_t i = 0; i < s.size(); ) {
-        char c = s[i];
-        if (c == '%' && i + 2 < s.size()) {
-            int h1 = hexval(s[i+1]);
-            int h2 = hexval(s[i+2]);
-            if (h1 >= 0 && h2 >= 0) {
-                char b = (char)((h1 << 4) | h2);
-                out.push_back(b);
-                i += 3;
-                continue;
-            }
-        }
-        if (c == '+') { 
-            out.push_back(' ');
-            i++;
-            continue;
-        }
-        out.push_back(c);
-        i++;
+static std::vector<std::string> read_vocab(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) die("Cannot open vocab file: " + path);
+
+    char magic[4];
+    u32 head[3];
+    if (!in.read(magic, 4) || !in.read((char*)head, sizeof(head))) die("vocab: bad header");
+    if (std::memcmp(magic, "IRVC", 4) != 0) die("vocab: bad magic, expected IRVC");
+    if (head[0] != 1) die("vocab: unsupported version (expected 1)");
+
+    std::vector<std::string> terms(head[2]);
+    for (auto& t : terms) {
+        u32 len;
+        if (!in.read((char*)&len, sizeof(len))) die("vocab: truncated");
+        t.resize(len);
+        if (len && !in.read(&t[0], len)) die("vocab: truncated");
     }
-    return out;
+    return terms;
 }
 
-static std::string title_from_url_norm(const std::string& url) {
-    std::string tail = url;
-    const std::string key = "/wiki/";
-    size_t p = url.find(key);
-    if (p != std::string::npos) tail = url.substr(p + key.size());
-    else {
-        size_t s = url.find_last_of('/');
-        if (s != std::string::npos && s + 1 < url.size()) tail = url.substr(s + 1);
-    }
-
-    for (char& c : tail) if (c == '_') c = ' ';
+template <class F>
+static void read_term_id_stream(const std::string& path, F&& on_pair) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) die("Cannot open tokens file: " + path);
 
+    char magic[4];
+    u32 head[3];
+    if (!in.read(magic, 4) || !in.read((char*)head, sizeof(head))) die("term id stream: bad header");
+    if (head[0] != 1) die("term id stream: unsupported version (expected 1)");
 
-    return percent_decode(tail);
+    std::vector<u32> buf(1 << 18);
+    while (true) {
+        in.read((char*)buf.data(), (std::streamsize)(buf.size() * sizeof(u32)));
+        size_t got = (size_t)in.gcount() / sizeof(u32);
+        if (got & 1u) die("term id stream: truncated pair");
+        for (size_t k = 0; k < got; k += 2) on_pair(buf[k], buf[k + 1]);
+        if (!in) break;
+    }
 }
 
 static std::vector<std::string> extract_url_norms_from_json(const std::string& path) {
@@ -174,65 +162,192 @@ static std::vector<std::string> extract_url_norms_from_json(const std::string& p
     return urls;
 }
 
-struct SectionInfo {
-    u32 type = 0;
-    u32 flags = 0;
-    u64 offset = 0;
-    u64 size = 0;
+// Таблица документов lr3_token --docs: "IRDT", u32 version, u32 count, u32 reserved,
+// далее u64 docid, u32 len + url_norm, u32 len + source, u64 updated_at,
+// u32 tokens, u32 bytes. docid -> url_norm берётся из неё без повторного чтения JSON.
+struct DocRow {
+    std::string url;
+    std::string source;
+    u64 updated_at = 0;
+    u32 tokens = 0;
+    u32 bytes = 0;
+    bool present = false;
 };
 
-static void write_u16(std::ofstream& out, u16 v) { out.write((char*)&v, sizeof(v)); }
-static void write_u32(std::ofstream& out, u32 v) { out.write((char*)&v, sizeof(v)); }
-static void write_u64(std::ofstream& out, u64 v) { out.write((char*)&v, sizeof(v)); }
-static void write_f64(std::ofstream& out, double v) { out.write((char*)&v, sizeof(v)); }
+static std::vector<DocRow> read_docs_table(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) die("Cannot open docs table: " + path);
+
+    char magic[4];
+    u32 head[3];
+    if (!in.read(magic, 4) || !in.read((char*)head, sizeof(head))) die("docs table: bad header");
+    if (std::memcmp(magic, "IRDT", 4) != 0) die("docs table: bad magic, expected IRDT");
+    if (head[0] != 1) die("docs table: unsupported version (expected 1)");
+
+    auto read_str = [&](std::string& s) {
+        u32 len;
+        if (!in.read((char*)&len, sizeof(len))) die("docs table: truncated");
+        s.resize(len);
+        if (len && !in.read(&s[0], len)) die("docs table: truncated");
+    };
+
+    std::vector<DocRow> rows;
+    for (u32 k = 0; k < head[1]; k++) {
+        u64 docid;
+        DocRow r;
+        if (!in.read((char*)&docid, sizeof(docid))) die("docs table: truncated");
+        read_str(r.url);
+        read_str(r.source);
+        if (!in.read((char*)&r.updated_at, 8) || !in.read((char*)&r.tokens, 4) || !in.read((char*)&r.bytes, 4))
+            die("docs table: truncated");
+        if (docid > std::numeric_limits<u32>::max()) die("docs table: docid out of u32 range");
+        if (docid >= rows.size()) rows.resize((size_t)docid + 1);
+        r.present = true;
+        rows[(size_t)docid] = std::move(r);
+    }
+    return rows;
+}
 
 int main(int argc, char** argv) {
-    if (argc < 3) {
+    std::vector<std::string> args;
+    std::string vocab_path, docs_path;
+    int yo_arg = -1;
+    for (int a = 1; a < argc; a++) {
+        if (std::strcmp(argv[a], "--vocab") == 0 && a + 1 < argc) vocab_path = argv[++a];
+        else if (std::strcmp(argv[a], "--yo") == 0 && a + 1 < argc) yo_arg = std::atoi(argv[++a]) != 0 ? 1 : 0;
+        else if (std::strcmp(argv[a], "--docs") == 0 && a + 1 < argc) docs_path = argv[++a];
+        else args.push_back(argv[a]);
+    }
+
+    if (args.size() < 2) {
         std::cerr <<
             "Usage:\n"
-            "  " << argv[0] << " <tokens.txt> <index.bin> [ir_lr2.documents.json]\n\n"
+            "  " << argv[0] << " <tokens.txt|tokens.bin|ids.bin> <index.bin> [ir_lr2.documents.json]\n"
+            "      [--vocab vocab.bin] [--docs docs.bin] [--yo 0|1]\n\n"
+            "  --yo 1: tokens.txt was written by lr3_token --yo 1 (text has no header;\n"
+            "          binary streams carry the flag and must agree with --yo if given)\n"
+            "  --docs: table from the same lr3_token run; per-document token counts\n"
+            "          must match the stream\n\n"
             "Examples:\n"
             "  " << argv[0] << " tokens.txt index.bin ir_lr2.documents.json\n"
-            "  " << argv[0] << " tokens.txt index.bin\n";
+            "  " << argv[0] << " tokens.txt index.bin\n"
+            "  " << argv[0] << " ids.bin index.bin --vocab vocab.bin\n"
+            "  " << argv[0] << " tokens.bin index.bin --docs docs.bin\n";
         return 1;
     }
 
-    const std::string tokens_path = argv[1];
-    const std::string out_path    = argv[2];
-    const bool has_json = (argc >= 4);
-    const std::string json_path = has_json ? argv[3] : "";
+    const std::string tokens_path = args[0];
+    const std::string out_path    = args[1];
+    const bool has_json = (args.size() >= 3);
+    const std::string json_path = has_json ? args[2] : "";
+    if (has_json && !docs_path.empty()) die("JSON and --docs are mutually exclusive");
 
     auto t0 = std::chrono::high_resolution_clock::now();
 
 
-    std::ifstream tin(tokens_path);
-    if (!tin) die("Cannot open tokens file: " + tokens_path);
-
     std::vector<TokenPair> pairs;
     pairs.reserve(1 << 20);
 
-    std::string line;
     u32 max_doc = 0;
     u64 total_tokens = 0;
-    u64 sum_term_len = 0;
 
-    while (std::getline(tin, line)) {
-        u32 docId = 0;
-        std::string tok;
-        if (!parse_tokens_line(line, docId, tok)) continue;
+    // Токены по документам — для сверки с таблицей --docs.
+    std::vector<u32> doc_tokens;
+    auto count_doc_token = [&](u32 docId) {
+        if (docs_path.empty()) return;
+        if (docId >= doc_tokens.size()) doc_tokens.resize((size_t)docId + 1);
+        doc_tokens[docId]++;
+    };
 
-        tok = to_lower_ascii(tok);
-        pairs.push_back({tok, docId});
+    auto add_token = [&](u32 docId, std::string tok) {
+        tok = fold_term(std::move(tok));
+        pairs.push_back({std::move(tok), docId});
+        count_doc_token(docId);
 
         if (docId > max_doc) max_doc = docId;
         total_tokens++;
-        sum_term_len += tok.size();
+    };
+
+    u32 stream_flags = 0;
+    const bool term_ids = is_term_id_stream(tokens_path);
+    const bool tokens_bin = term_ids || is_token_stream_bin(tokens_path, &stream_flags);
+    if (term_ids) {
+        std::ifstream hin(tokens_path, std::ios::binary);
+        u32 head[4];
+        if (hin.read((char*)head, sizeof(head))) stream_flags = head[2];
+        if (vocab_path.empty()) die("term id stream requires --vocab");
+    }
+    // Свёртку ё текстовый поток не хранит: её задаёт --yo, и она же уходит
+    // в META, чтобы lr7 сворачивал запросы так же.
+    bool fold_yo = (stream_flags & kTsFoldYo) != 0;
+    if (!tokens_bin) fold_yo = yo_arg == 1;
+    else if (yo_arg >= 0 && (yo_arg == 1) != fold_yo)
+        die(std::string("--yo ") + (yo_arg ? "1" : "0") + " does not match the token stream header");
+    init_fold_tables(fold_yo);
+
+    // Поток id: термы уже интернированы, поэтому вместо сортировки строк
+    // сортируются ключи (ранг терма << 32 | doc) поразрядной сортировкой.
+    std::vector<std::string> id_terms;
+    std::vector<u32> id_rank;
+    std::vector<u64> id_keys;
+
+    if (term_ids) {
+        std::vector<std::string> vocab = read_vocab(vocab_path);
+        for (auto& t : vocab) t = fold_term(std::move(t));
+
+        id_terms = vocab;
+        std::sort(id_terms.begin(), id_terms.end());
+        id_terms.erase(std::unique(id_terms.begin(), id_terms.end()), id_terms.end());
+
+        id_rank.resize(vocab.size());
+        for (size_t k = 0; k < vocab.size(); k++)
+            id_rank[k] = (u32)(std::lower_bound(id_terms.begin(), id_terms.end(), vocab[k]) - id_terms.begin());
+
+        id_keys.reserve(1 << 20);
+        read_term_id_stream(tokens_path, [&](u32 docId, u32 id) {
+            if (id >= vocab.size()) die("term id stream: term id out of vocab range");
+            id_keys.push_back(((u64)id_rank[id] << 32) | docId);
+            count_doc_token(docId);
+            if (docId > max_doc) max_doc = docId;
+            total_tokens++;
+        });
+    } else if (tokens_bin) {
+        read_token_stream_bin(tokens_path, [&](u64 doc, u32, const char* p, size_t len) {
+            add_token((u32)doc, std::string(p, len));
+        });
+    } else {
+        std::ifstream tin(tokens_path);
+        if (!tin) die("Cannot open tokens file: " + tokens_path);
+
+        std::string line;
+        while (std::getline(tin, line)) {
+            u32 docId = 0;
+            std::string tok;
+            if (!parse_tokens_line(line, docId, tok)) continue;
+            add_token(docId, std::move(tok));
+        }
     }
 
-    if (pairs.empty()) die("No tokens parsed from " + tokens_path);
+    if (total_tokens == 0) die("No tokens parsed from " + tokens_path);
 
     u32 docs_count = max_doc + 1;
 
+    std::vector<DocRow> doc_rows;
+    if (!docs_path.empty()) {
+        doc_rows = read_docs_table(docs_path);
+        if (doc_rows.size() > docs_count) docs_count = (u32)doc_rows.size();
+        // Таблица и поток должны описывать одни и те же документы: число
+        // токенов каждого docid обязано совпасть, иначе url достались бы чужим.
+        for (size_t d = 0; d < std::max(doc_rows.size(), doc_tokens.size()); d++) {
+            u32 got = d < doc_tokens.size() ? doc_tokens[d] : 0;
+            bool present = d < doc_rows.size() && doc_rows[d].present;
+            if (present ? doc_rows[d].tokens != got : got != 0)
+                die("docs table does not match the token stream at docid " + std::to_string(d) +
+                    " (" + std::to_string(present ? doc_rows[d].tokens : 0) + " tokens in table, " +
+                    std::to_string(got) + " in stream)");
+        }
+    }
+
     std::vector<std::string> urls;
     if (has_json) {
         urls = extract_url_norms_from_json(json_path);
@@ -241,176 +356,85 @@ int main(int argc, char** argv) {
         }
     }
 
-    std::vector<std::string> fwd_url(docs_count), fwd_title(docs_count);
-
+    std::vector<std::string> fwd_url(docs_count);
     for (u32 d = 0; d < docs_count; d++) {
-        if (!urls.empty() && d < (u32)urls.size()) {
-            fwd_url[d] = urls[d];
-            fwd_title[d] = title_from_url_norm(urls[d]);
-            if (fwd_title[d].empty()) fwd_title[d] = "Document " + std::to_string(d);
-        } else {
-            fwd_url[d] = "";
-            fwd_title[d] = "Document " + std::to_string(d);
-        }
+        if (d < (u32)doc_rows.size() && doc_rows[d].present) fwd_url[d] = doc_rows[d].url;
+        else if (d < (u32)urls.size()) fwd_url[d] = urls[d];
     }
 
-    std::sort(pairs.begin(), pairs.end(),
-        [](const TokenPair& a, const TokenPair& b) {
-            if (a.term < b.term) return true;
-            if (a.term > b.term) return false;
-            return a.doc < b.doc;
-        }
-    );
-
-
-    std::vector<DictEntry> dict;
-    dict.reserve(100000);
-
-    std::vector<u32> postings_blob;
-    postings_blob.reserve(pairs.size());
-
-    u32 unique_terms = 0;
-
-    size_t i = 0;
-    while (i < pairs.size()) {
-        const std::string& term = pairs[i].term;
-        u64 postings_off = (u64)postings_blob.size() * sizeof(u32);
-
-        u32 last_doc = std::numeric_limits<u32>::max();
-        u32 df = 0;
-
-        while (i < pairs.size() && pairs[i].term == term) {
-            u32 d = pairs[i].doc;
-            if (d != last_doc) {
-                postings_blob.push_back(d);
-                last_doc = d;
-                df++;
+    IrixWriter w;
+    std::vector<u32> docs_buf;
+
+    if (term_ids) {
+        radix_sort_u64(id_keys);
+
+        size_t i = 0;
+        while (i < id_keys.size()) {
+            u32 rank = (u32)(id_keys[i] >> 32);
+            docs_buf.clear();
+
+            u32 last_doc = std::numeric_limits<u32>::max();
+            u32 df = 0;
+            u64 cf = 0;
+
+            while (i < id_keys.size() && (u32)(id_keys[i] >> 32) == rank) {
+                u32 d = (u32)id_keys[i];
+                cf++;
+                if (d != last_doc) {
+                    docs_buf.push_back(d);
+                    last_doc = d;
+                    df++;
+                }
+                i++;
             }
-            i++;
-        }
-
-        dict.push_back({term, df, postings_off});
-        unique_terms++;
-    }
-
-    double avg_term_len = (unique_terms > 0) ? (double)sum_term_len / (double)total_tokens : 0.0;
-
-    auto t1 = std::chrono::high_resolution_clock::now();
-    double build_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
-
-
-    std::ofstream out(out_path, std::ios::binary);
-    if (!out) die("Cannot open output file: " + out_path);
-
-
-    char magic[4] = {'I','R','I','X'};
-    out.write(magic, 4);
-    write_u32(out, 1);
-    write_u32(out, 0);
-    write_u64(out, 0);
-
-    std::vector<SectionInfo> sections;
-
-    auto mark_section = [&](u32 type, u32 flags, u64 start_off) {
-        SectionInfo s;
-        s.type = type;
-        s.flags = flags;
-        s.offset = start_off;
-        s.size = 0;
-        sections.push_back(s);
-    };
-
-    auto cur_off = [&]() -> u64 {
-        return (u64)out.tellp();
-    };
-
-
-    {
-        u64 start = cur_off();
-        mark_section(4, 0, start);
-
-        write_u32(out, docs_count);
-        write_u64(out, total_tokens);
-        write_u32(out, unique_terms);
-        write_f64(out, avg_term_len);
-        write_f64(out, build_ms);
-
-        sections.back().size = cur_off() - start;
-    }
-
 
-    {
-        u64 start = cur_off();
-        mark_section(1, 0, start);
-
-        write_u32(out, (u32)dict.size());
-        for (const auto& e : dict) {
-            if (e.term.size() > 65535) die("Term too long (>65535 bytes): " + e.term);
-            write_u16(out, (u16)e.term.size());
-            out.write(e.term.data(), (std::streamsize)e.term.size());
-            write_u32(out, e.df);
-            write_u64(out, e.postings_off);
-        }
-
-        sections.back().size = cur_off() - start;
-    }
-
-
-    {
-        u64 start = cur_off();
-        mark_section(2, 0, start);
-
-
-        if (!postings_blob.empty()) {
-            out.write((const char*)postings_blob.data(),
-                      (std::streamsize)(postings_blob.size() * sizeof(u32)));
+            w.add_term(id_terms[rank].data(), id_terms[rank].size(), docs_buf.data(), df, cf);
         }
+    } else {
+        std::sort(pairs.begin(), pairs.end(),
+            [](const TokenPair& a, const TokenPair& b) {
+                if (a.term < b.term) return true;
+                if (a.term > b.term) return false;
+                return a.doc < b.doc;
+            }
+        );
+
+        size_t i = 0;
+        while (i < pairs.size()) {
+            const std::string& term = pairs[i].term;
+            docs_buf.clear();
+
+            u32 last_doc = std::numeric_limits<u32>::max();
+            u32 df = 0;
+            u64 cf = 0;
+
+            while (i < pairs.size() && pairs[i].term == term) {
+                u32 d = pairs[i].doc;
+                cf++;
+                if (d != last_doc) {
+                    docs_buf.push_back(d);
+                    last_doc = d;
+                    df++;
+                }
+                i++;
+            }
 
-        sections.back().size = cur_off() - start;
-    }
-
-
-    {
-        u64 start = cur_off();
-        mark_section(3, 0, start);
-
-        write_u32(out, docs_count);
-        for (u32 d = 0; d < docs_count; d++) {
-            const std::string& url = fwd_url[d];
-            const std::string& ttl = fwd_title[d];
-
-            write_u32(out, (u32)url.size());
-            if (!url.empty()) out.write(url.data(), (std::streamsize)url.size());
-
-            write_u32(out, (u32)ttl.size());
-            if (!ttl.empty()) out.write(ttl.data(), (std::streamsize)ttl.size());
+            w.add_term(term.data(), term.size(), docs_buf.data(), df, cf);
         }
-
-        sections.back().size = cur_off() - start;
     }
 
-    u64 table_off = cur_off();
-    for (const auto& s : sections) {
-        write_u32(out, s.type);
-        write_u32(out, s.flags);
-        write_u64(out, s.offset);
-        write_u64(out, s.size);
-    }
-
-    out.seekp(4 + 4, std::ios::beg);
-    write_u32(out, (u32)sections.size());
-    write_u64(out, table_off);
-
-    out.close();
+    auto t1 = std::chrono::high_resolution_clock::now();
+    double build_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
 
+    w.write(out_path, docs_count, kMetaFoldCase | (fold_yo ? kMetaFoldYo : 0u), build_ms, fwd_url);
 
     double tokens_per_ms = (build_ms > 0.0) ? (double)total_tokens / build_ms : 0.0;
 
     std::cout << "OK: wrote " << out_path << "\n";
     std::cout << "Docs: " << docs_count << "\n";
     std::cout << "Total tokens: " << total_tokens << "\n";
-    std::cout << "Unique terms: " << unique_terms << "\n";
-    std::cout << "Avg token(term) length (bytes): " << avg_term_len << "\n";
+    std::cout << "Unique terms: " << w.unique_terms << "\n";
+    std::cout << "Avg token(term) length (bytes): " << w.avg_term_len() << "\n";
     std::cout << "Indexing time (ms): " << build_ms << "\n";
     std::cout << "Tokens per ms: " << tokens_per_ms << " (~" << (tokens_per_ms * 1000.0) << " tokens/s)\n";
 
@@ -11,6 +11,9 @@
 #include <string>
 #include <vector>
 
+#include "fold.h"
+#include "irix.h"
+
 using u8  = uint8_t;
 using u16 = uint16_t;
 using u32 = uint32_t;
@@ -33,6 +36,15 @@ static std::string to_lower_ascii(std::string s) {
     return s;
 }
 
+// Полная свёртка включается только для индексов, собранных со свёрткой
+// (флаг kMetaFoldCase в META); старые индексы хранят термы как есть,
+// с приведением к нижнему регистру только ASCII.
+static bool g_fold_case = false;
+
+static std::string normalize_query_term(std::string s) {
+    return g_fold_case ? fold_term(std::move(s)) : to_lower_ascii(std::move(s));
+}
+
 struct SectionInfo {
     u32 type = 0;
     u32 flags = 0;
@@ -68,6 +80,7 @@ static double read_f64(std::ifstream& in) {
 struct DictEntry {
     std::string term;
     u32 df = 0;
+    u64 cf = 0;  // только в IRIX v2, в v1 — 0
     u64 postings_off = 0; 
 };
 
@@ -78,6 +91,7 @@ struct DocInfo {
 
 struct Index {
     u32 docs_count = 0;
+    u32 meta_flags = 0;
     std::vector<DictEntry> dict;
     std::vector<u32> postings;
     std::vector<DocInfo> docs; 
@@ -103,7 +117,7 @@ static Index load_index(const std::string& path) {
     }
 
     u32 version = read_u32(in);
-    if (version != 1) die("Unsupported version (expected 1)");
+    if (version != 1 && version != 2) die("Unsupported version (expected 1 or 2)");
 
     u32 section_count = read_u32(in);
     u64 section_table_off = read_u64(in);
@@ -135,6 +149,7 @@ static Index load_index(const std::string& path) {
 
     in.seekg((std::streamoff)meta.offset, std::ios::beg);
     if (!in) die("seekg to META failed");
+    idx.meta_flags = meta.flags;
     idx.docs_count = read_u32(in);
     (void)read_u64(in);
     (void)read_u32(in);
@@ -155,9 +170,10 @@ static Index load_index(const std::string& path) {
         if (!in) die("DICT: failed reading term bytes");
 
         u32 df = read_u32(in);
+        u64 cf = version >= 2 ? read_u64(in) : 0;
         u64 off = read_u64(in);
 
-        idx.dict.push_back({term, df, off});
+        idx.dict.push_back({term, df, cf, off});
     }
 
     if (postS.size % sizeof(u32) != 0) die("POSTINGS size is not multiple of 4");
@@ -291,7 +307,7 @@ static std::vector<Tok> tokenize_query(const std::string& line_raw) {
     size_t i = 0;
 
     auto push_term = [&](const std::string& s) {
-        if (!s.empty()) toks.push_back({TokType::TERM, to_lower_ascii(s)});
+        if (!s.empty()) toks.push_back({TokType::TERM, normalize_query_term(s)});
     };
 
     while (i < line_raw.size()) {
@@ -525,6 +541,8 @@ int main(int argc, char** argv) {
     }
 
     Index idx = load_index(index_path);
+    g_fold_case = (idx.meta_flags & kMetaFoldCase) != 0;
+    if (g_fold_case) init_fold_tables((idx.meta_flags & kMetaFoldYo) != 0);
     std::vector<u32> universe = make_universe(idx.docs_count);
 
     std::ofstream rep;
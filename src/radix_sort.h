@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// LSD radix sort 64-битных ключей по 16-битным разрядам; разряды, одинаковые
+// у всех ключей (обычно старшие), пропускаются. Общая для lr5_stem и lr6_index.
+static void radix_sort_u64(std::vector<uint64_t>& a) {
+    const size_t n = a.size();
+    std::vector<uint64_t> hist(4 << 16, 0);
+    for (uint64_t v : a)
+        for (int d = 0; d < 4; d++) hist[((size_t)d << 16) | ((v >> (16 * d)) & 0xFFFFu)]++;
+
+    std::vector<uint64_t> tmp(n);
+    for (int d = 0; d < 4; d++) {
+        uint64_t* h = &hist[(size_t)d << 16];
+        if (n == 0 || h[(a[0] >> (16 * d)) & 0xFFFFu] == n) continue;
+        uint64_t sum = 0;
+        for (size_t b = 0; b < (1u << 16); b++) { uint64_t c = h[b]; h[b] = sum; sum += c; }
+        for (uint64_t v : a) tmp[h[(v >> (16 * d)) & 0xFFFFu]++] = v;
+        a.swap(tmp);
+    }
+}
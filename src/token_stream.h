@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Бинарный поток токенов lr3_token --format bin (IRTK), общий для писателя
+// (lr3_token) и читателей (lr4_zipf, lr5_stem, lr6_index):
+//   заголовок: "IRTK", u32 version, u32 flags, u32 reserved;
+//   блоки: u32 tokens, u32 docs, u32 payload_bytes, затем payload —
+//   для каждого токена varint(docid - docid предыдущего токена), [varint id поля],
+//   [varint-дельта смещения], varint(len), байты;
+//   необязательные поля есть, если в flags стоят kTsFields/kTsOffsets.
+// Первый токен блока кодирует docid от нуля, так что блоки независимы;
+// смещения сбрасываются в каждом поле документа. Порядковые номера токенов
+// не пишутся: они неявно заданы порядком токенов внутри каждой пары (docid, поле).
+// Поток id термов (--emit_ids): заголовок "IRTI" как у IRTK, затем пары
+// u32 (docid, term_id). Словарь (--vocab): "IRVC", u32 version, u32 flags,
+// u32 count, затем для каждого id по порядку u32 длина + байты терма.
+static const uint32_t kTokStreamVersion = 1;
+static const uint32_t kTsFoldCase = 1u;
+static const uint32_t kTsFoldYo   = 2u;
+static const uint32_t kTsOffsets  = 8u;
+static const uint32_t kTsFields   = 16u;
+
+[[noreturn]] static void token_stream_fail(const char* msg) {
+    std::fprintf(stderr, "ERROR: token stream: %s\n", msg);
+    std::exit(1);
+}
+
+static inline uint64_t read_varint(const uint8_t*& p, const uint8_t* end) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (p >= end) token_stream_fail("truncated varint");
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7Fu) << shift;
+        if (!(b & 0x80u)) return v;
+    }
+    token_stream_fail("bad varint");
+}
+
+// true, если файл начинается с "IRTK"; flags — флаги из заголовка.
+static inline bool is_token_stream_bin(const std::string& path, uint32_t* flags = nullptr) {
+    std::ifstream in(path, std::ios::binary);
+    char m[4];
+    uint32_t head[2];
+    if (!in.read(m, 4) || std::memcmp(m, "IRTK", 4) != 0) return false;
+    if (flags) *flags = in.read((char*)head, sizeof(head)) ? head[1] : 0u;
+    return true;
+}
+
+// Разбор payload одного блока: on_token(docid, id поля, байты, длина).
+template <class F>
+static void decode_token_block(const uint8_t* p, const uint8_t* end, uint32_t tokens, uint32_t flags,
+                               F&& on_token) {
+    uint64_t doc = 0;
+    for (uint32_t t = 0; t < tokens; t++) {
+        doc += read_varint(p, end);
+        uint64_t field = (flags & kTsFields) ? read_varint(p, end) : 0;
+        if (flags & kTsOffsets) read_varint(p, end);
+        uint64_t len = read_varint(p, end);
+        if (len > (uint64_t)(end - p)) token_stream_fail("token out of block");
+        on_token(doc, (uint32_t)field, (const char*)p, (size_t)len);
+        p += len;
+    }
+}
+
+// Блоки потока после заголовка, по одному в памяти.
+template <class F>
+static void read_token_blocks(std::istream& in, uint32_t flags, F&& on_token) {
+    std::vector<uint8_t> payload;
+    uint32_t blk[3];
+    while (in.read((char*)blk, sizeof(blk))) {
+        payload.resize(blk[2]);
+        if (blk[2] && !in.read((char*)payload.data(), (std::streamsize)blk[2])) token_stream_fail("truncated block");
+        decode_token_block(payload.data(), payload.data() + payload.size(), blk[0], flags, on_token);
+    }
+}
+
+template <class F>
+static void read_token_stream_bin(const std::string& path, F&& on_token) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) token_stream_fail(("cannot open " + path).c_str());
+
+    char magic[4];
+    uint32_t head[3];
+    if (!in.read(magic, 4) || !in.read((char*)head, sizeof(head))) token_stream_fail("bad header");
+    if (std::memcmp(magic, "IRTK", 4) != 0) token_stream_fail("bad magic, expected IRTK");
+    if (head[0] != kTokStreamVersion) token_stream_fail("unsupported version (expected 1)");
+    read_token_blocks(in, head[1], on_token);
+}